@@ -1,4 +1,4 @@
-import random, socket, errno, time, logging
+import os, random, socket, errno, time, logging
 
 from _coev import *
 from _coev import __version__
@@ -23,6 +23,19 @@ addresses are supplied as:
 
 """
 
+def parse_endpoint(ep):
+    """ converts an address in one of the above forms into (AF, TYPE, addr) """
+    if len(ep) == 1:
+        return (socket.AF_UNIX, socket.SOCK_STREAM, ep[0])
+    elif len(ep) == 2:
+        if ':' in ep[0]:
+            return (socket.AF_INET6, socket.SOCK_STREAM, ep)
+        else:
+            return (socket.AF_INET, socket.SOCK_STREAM, ep)
+    elif len(ep) == 3:
+        return (ep[0], ep[1], ep[2])
+    raise ValueError("wrond endpoint format {0!r}".format(ep))
+
 class TooManyConnections(Exception):
     pass
     
@@ -46,12 +59,15 @@ class WriteTimeout(IOpTimeout):
 
 class Connection(object):
     """ those are stored in the connection pool """
-    def __init__(self, pool, endpoint, conn_timeout, iop_timeout, read_limit):
+    def __init__(self, pool, endpoint, conn_timeout, iop_timeout, read_limit, sock=None):
+        """ sock is an already connected socket, e.g. from adopt() """
         self.pool = pool
         
-        s = socket.socket(endpoint[0], endpoint[1])
-        s.setblocking(0)
-        while True:
+        s = sock
+        if s is None:
+            s = socket.socket(endpoint[0], endpoint[1])
+            s.setblocking(0)
+        while sock is None:
             try:
                 s.connect(endpoint[2])
             except socket.error, msg:
@@ -85,33 +101,40 @@ class ConnectionProxy(object):
     def __init__(self, connection):
         self.conn = connection
 
+    def failed(self, status, timeout_exc):
+        self.conn.dead = True
+        if status == errno.ETIMEDOUT:
+            raise timeout_exc(repr(self.conn))
+        e = SocketError(status, os.strerror(status))
+        e.conn = repr(self.conn)
+        raise e
+
     def read(self, hint=0):
-        try:
-            return self.conn.sfile.read(hint)
-        except Exception, e:
-            self.conn.dead = True
-            if e.errno == 110: 
-                raise ReadTimeout(repr(self.conn))
-            e.conn = repr(self.conn)
-            raise e
+        status, data = self.conn.sfile.try_read(hint)
+        if status > 0:
+            self.failed(status, ReadTimeout)
+        return data
         
     def readline(self, hint=0):
-        try:
-            return self.conn.sfile.readline(hint)
-        except Exception, e:
-            self.conn.dead = True
-            if e.errno == 110: 
-                raise ReadTimeout(repr(self.conn))
-            e.conn = repr(self.conn)
-            raise e
+        status, data = self.conn.sfile.try_readline(hint)
+        if status > 0:
+            self.failed(status, ReadTimeout)
+        return data
         
     def write(self, data):
+        status, written = self.conn.sfile.try_write(data)
+        if status > 0:
+            self.failed(status, WriteTimeout)
+        return written
+
+    def call(self, method, *args):
+        """ calls any other socketfile method, handling errors as above """
         try:
-            return self.conn.sfile.write(data)
+            return getattr(self.conn.sfile, method)(*args)
         except Exception, e:
             self.conn.dead = True
-            if e.errno == 110: 
-                raise WriteTimeout(repr(self.conn))
+            if getattr(e, 'errno', None) == 110:
+                raise IOpTimeout(repr(self.conn))
             e.conn = repr(self.conn)
             raise e
 
@@ -133,17 +156,7 @@ class ConnectionPool(object):
         self.dead_endpoints = []
         self.gets = 0
         for ep in endpoints:
-            if len(ep) == 1:
-                self.endpoints.append((socket.AF_UNIX, socket.SOCK_STREAM, ep[0]))
-            elif len(ep) == 2:
-                if ':' in ep[0]:
-                    self.endpoints.append((socket.AF_INET6, socket.SOCK_STREAM, ep))
-                else:
-                    self.endpoints.append((socket.AF_INET, socket.SOCK_STREAM, ep))
-            elif len(ep) == 3:
-                self.endpoints.append((ep[0], ep[1], ep[2]))
-            else:
-                raise ValueError("wrond endpoint format {0!r}".format(ep))
+            self.endpoints.append(parse_endpoint(ep))
         
     def get(self):
         self.gets += 1
@@ -202,6 +215,102 @@ class ConnectionPool(object):
             c.close()
         self.available = []
 
+    def adopt(self, connections):
+        """ takes (endpoint, socket) pairs, see coev.adopt(), for this pool's
+            endpoints as idle connections; returns how many were taken.
+            The rest are left alone, they may be for another pool. """
+        ours = dict((_endpoint_key(ep), ep) for ep in self.endpoints)
+        n = 0
+        for endpoint, sock in connections:
+            endpoint = ours.get(_endpoint_key(endpoint))
+            if endpoint is not None and len(self.available) + len(self.busy) < self.conn_limit:
+                self.available.append(Connection(self, endpoint, self.conn_timeout,
+                    self.iop_timeout, self.read_limit, sock))
+                n += 1
+        return n
+
+def _endpoint_key(ep):
+    """ parse_endpoint() form, hashable: addresses given as lists become tuples """
+    af, type_, addr = parse_endpoint(ep)
+    if isinstance(addr, list):
+        addr = tuple(addr)
+    return (af, type_, addr)
+
+DEFAULT_STACK_SIZE = 2 * 1024 * 1024 # what ucoev's PyThread_start_new_thread uses
+MIN_STACK_SIZE = 16384
+
+def spawn(func, *args, **kwargs):
+    """ spawn(func, *args, **kwargs) -> id
+
+    starts func(*args, **kwargs) in a new coroutine, as thread.start_new_thread()
+    does, and records its stack size, see stackinfo(); its CPU time is
+    accounted for from the first run to the last, see starter(). 
+    stack_size keyword argument sets the stack size for this coroutine only,
+    at least MIN_STACK_SIZE, rounded up to whole pages; it is not passed
+    to func. Stacks are not pooled by size, so there is no point in
+    rounding further.
+    copy_locals=True starts the coroutine with copies of the caller's
+    coev.local values, see local_snapshot(); otherwise it starts with none.
+    """
+    import thread
+    stack_size = kwargs.pop('stack_size', 0)
+    if kwargs.pop('copy_locals', False):
+        func, args, kwargs = _with_locals, (local_snapshot(), func, args, kwargs), {}
+    func = starter(func, args, kwargs)
+    if stack_size:
+        stack_size = (max(stack_size, MIN_STACK_SIZE) + 4095) & ~4095
+        old = thread.stack_size(stack_size)
+        try:
+            tid = thread.start_new_thread(func, ())
+        finally:
+            thread.stack_size(old)
+    else:
+        # stack_size() without an argument resets it to the default
+        stack_size = thread.stack_size()
+        thread.stack_size(stack_size)
+        stack_size = stack_size or DEFAULT_STACK_SIZE
+        tid = thread.start_new_thread(func, ())
+    setstacksize(tid, stack_size)
+    return tid
+
+def _with_locals(snapshot, func, args, kwargs):
+    local_restore(snapshot)
+    return func(*args, **kwargs)
+
+_watchdog = { 'threshold': 0, 'tid': None }
+
+def watchdog(threshold_ms, interval=1.0, logger=None):
+    """ watchdog(threshold_ms, interval=1.0, logger=None) -> None
+
+    logs coroutines that kept the CPU for more than threshold_ms between 
+    switches, with treepos and the Python stack they were running when
+    the threshold passed (see hogs()).
+    a coroutine draining hogs() every interval seconds is started once;
+    threshold_ms=0 disarms the watchdog and makes it exit.
+    """
+    setwatchdog(threshold_ms)
+    _watchdog['threshold'] = threshold_ms
+    if threshold_ms and _watchdog['tid'] is None:
+        import thread
+        _watchdog['tid'] = thread.start_new_thread(_watchdog_drain, 
+            (interval, logger or logging.getLogger('coev.watchdog')))
+
+def _watchdog_drain(interval, el):
+    import traceback
+    try:
+        while _watchdog['threshold']:
+            sleep(interval)
+            for tid, treepos, held, stack in hogs():
+                el.warning("coroutine {0:#x} [{1}] held the CPU for {2:.1f} ms, at\n{3}".format(
+                    tid, treepos, held * 1000.0, ''.join(traceback.format_list(
+                    [ (fn, ln, name, None) for fn, ln, name in stack ]))))
+    finally:
+        _watchdog['tid'] = None
+
+from coev.prefork import prefork, Supervisor
+from coev.process import Process
+from coev.restart import handoff, adopt, drain
+
 # simple connect
 
 def test_one(addr):
@@ -0,0 +1,435 @@
+#!/usr/bin/python
+# -*- encoding: utf-8 -*-
+
+import sys, os, time, json, socket, errno, argparse, platform, thread
+
+import coev
+
+"""
+micro-benchmark suite.
+
+    python -m coev.bench [-duration 2] [-only switch,stall] [-output new.json]
+                         [-compare baseline.json [-threshold 5]] [-slowswitch]
+
+Every benchmark runs for -duration seconds and reports ops, ops_per_sec,
+and, where individual operations are timed (in batches for the very
+fast ones), mean and p50/p90/p99/p999 latency in seconds, along with
+deltas of coev.stats() counters over the run.
+
+Results are printed or written to -output as JSON. With -compare, each
+benchmark is compared to the baseline file: a throughput drop or a p99
+rise of more than -threshold percent is a regression, and the exit
+status is 1 if there are any.
+
+-slowswitch turns off switching with the GIL kept (setfastswitch()), so
+what it gains shows up as a comparison of two runs:
+
+    python -m coev.bench -only switch,throw -slowswitch -output slow.json
+    python -m coev.bench -only switch,throw -compare slow.json
+"""
+
+def percentiles(samples):
+    if not samples:
+        return {}
+    samples = sorted(samples)
+    n = len(samples)
+    def q(p):
+        return samples[min(n - 1, int(p * n))]
+    return {
+        'mean': sum(samples) / n,
+        'p50': q(0.5), 'p90': q(0.9), 'p99': q(0.99), 'p999': q(0.999),
+    }
+
+def result(ops, seconds, samples=None, **params):
+    rv = { 'ops': ops, 'seconds': seconds, 'ops_per_sec': ops / seconds if seconds else 0.0 }
+    if samples:
+        rv.update(percentiles(samples))
+    rv.update(params)
+    return rv
+
+def wait_for(cond):
+    """ stall until cond() is true """
+    while not cond():
+        coev.stall()
+
+# coroutine switching
+
+class Ping(Exception):
+    pass
+
+def bench_switch(duration, batch=100):
+    """ direct switch() ping-pong between two coroutines """
+    me = coev.current()
+    state = { 'stop': False, 'ready': False }
+    def partner():
+        state['ready'] = True
+        coev.switch2scheduler()
+        while not state['stop']:
+            coev.switch(me)
+        coev.schedule(me)
+    peer = thread.start_new_thread(partner, ())
+    wait_for(lambda: state['ready'])
+
+    samples = []
+    ops = 0
+    start = time.time()
+    while time.time() - start < duration:
+        t0 = time.time()
+        for x in xrange(batch):
+            coev.switch(peer)
+        samples.append((time.time() - t0) / (2 * batch))
+        ops += 2 * batch
+    seconds = time.time() - start
+    state['stop'] = True
+    coev.switch(peer)
+    return result(ops, seconds, samples)
+
+def bench_throw(duration, batch=100):
+    """ throw() into a coroutine that catches and switches back """
+    me = coev.current()
+    state = { 'stop': False, 'ready': False }
+    def partner():
+        state['ready'] = True
+        coev.switch2scheduler()
+        while not state['stop']:
+            try:
+                coev.switch(me)
+            except Ping:
+                pass
+        coev.schedule(me)
+    peer = thread.start_new_thread(partner, ())
+    wait_for(lambda: state['ready'])
+
+    samples = []
+    ops = 0
+    start = time.time()
+    while time.time() - start < duration:
+        t0 = time.time()
+        for x in xrange(batch):
+            coev.throw(peer, Ping)
+        samples.append((time.time() - t0) / batch)
+        ops += batch
+    seconds = time.time() - start
+    state['stop'] = True
+    coev.switch(peer)
+    return result(ops, seconds, samples)
+
+def stack_filler(depth, fn):
+    if depth > 0:
+        return stack_filler(depth - 1, fn)
+    return fn()
+
+def bench_stall(duration, num=512, depth=32):
+    """ num coroutines stall() at some stack depth, as switcher.py did """
+    state = { 'stop': False, 'count': 0, 'alive': num }
+    def staller():
+        while not state['stop']:
+            state['count'] += 1
+            coev.stall()
+        state['alive'] -= 1
+    for x in xrange(num):
+        thread.start_new_thread(stack_filler, (depth, staller))
+    coev.sleep(0.1) # settle
+    state['count'] = 0
+    start = time.time()
+    coev.sleep(duration)
+    ops = state['count']
+    seconds = time.time() - start
+    state['stop'] = True
+    wait_for(lambda: not state['alive'])
+    return result(ops, seconds, num=num, depth=depth)
+
+# I/O
+
+def bench_wait_pingpong(duration):
+    """ one-byte ping-pong over a socketpair with wait() and plain sockets """
+    a, b = socket.socketpair()
+    a.setblocking(0)
+    b.setblocking(0)
+    state = { 'stop': False, 'done': False }
+    def ponger():
+        try:
+            while True:
+                coev.wait(b.fileno(), coev.READ, 5.0)
+                if not b.recv(1):
+                    break
+                b.send('p')
+        finally:
+            state['done'] = True
+    thread.start_new_thread(ponger, ())
+
+    samples = []
+    start = time.time()
+    while time.time() - start < duration:
+        t0 = time.time()
+        a.send('p')
+        coev.wait(a.fileno(), coev.READ, 5.0)
+        a.recv(1)
+        samples.append(time.time() - t0)
+    seconds = time.time() - start
+    a.shutdown(socket.SHUT_WR)
+    wait_for(lambda: state['done'])
+    a.close()
+    b.close()
+    return result(len(samples), seconds, samples)
+
+def _socketfile_pair(rlim):
+    a, b = socket.socketpair()
+    a.setblocking(0)
+    b.setblocking(0)
+    return a, b, coev.socketfile(a.fileno(), 5.0, rlim), coev.socketfile(b.fileno(), 5.0, rlim)
+
+def _feeder(sfile, chunk, state):
+    while not state['stop']:
+        sfile.write(chunk)
+    state['fed'] = True
+
+def bench_readline(duration, size):
+    """ socketfile.readline() of size-byte lines """
+    a, b, ra, wb = _socketfile_pair(max(4096, size * 2))
+    line = 'x' * (size - 1) + '\n'
+    state = { 'stop': False, 'fed': False }
+    thread.start_new_thread(_feeder, (wb, line * max(1, 65536 // size), state))
+    samples = []
+    nbytes = 0
+    start = time.time()
+    while time.time() - start < duration:
+        t0 = time.time()
+        nbytes += len(ra.readline())
+        samples.append(time.time() - t0)
+    seconds = time.time() - start
+    state['stop'] = True
+    while not state['fed']:
+        ra.read(65536)
+    a.close()
+    b.close()
+    return result(len(samples), seconds, samples, size=size,
+                    bytes_per_sec=nbytes / seconds)
+
+def bench_read(duration, size):
+    """ socketfile.read(size) """
+    a, b, ra, wb = _socketfile_pair(max(4096, size))
+    state = { 'stop': False, 'fed': False }
+    thread.start_new_thread(_feeder, (wb, 'x' * 65536, state))
+    samples = []
+    nbytes = 0
+    start = time.time()
+    while time.time() - start < duration:
+        t0 = time.time()
+        nbytes += len(ra.read(size))
+        samples.append(time.time() - t0)
+    seconds = time.time() - start
+    state['stop'] = True
+    while not state['fed']:
+        ra.read(65536)
+    a.close()
+    b.close()
+    return result(len(samples), seconds, samples, size=size,
+                    bytes_per_sec=nbytes / seconds)
+
+# coordination
+
+def bench_colock(duration, num=16):
+    """ num coroutines contend for one lock, stall()ing while holding it """
+    lock = thread.allocate_lock()
+    state = { 'stop': False, 'alive': num }
+    samples = []
+    def contender():
+        while not state['stop']:
+            t0 = time.time()
+            lock.acquire()
+            samples.append(time.time() - t0)
+            coev.stall()
+            lock.release()
+        state['alive'] -= 1
+    start = time.time()
+    for x in xrange(num):
+        thread.start_new_thread(contender, ())
+    coev.sleep(duration)
+    state['stop'] = True
+    wait_for(lambda: not state['alive'])
+    seconds = time.time() - start
+    return result(len(samples), seconds, samples, num=num)
+
+def bench_spawn(duration, batch=100):
+    """ spawn batches of coroutines that return at once, wait for them to finish """
+    state = { 'done': 0 }
+    def noop():
+        state['done'] += 1
+    samples = []
+    ops = 0
+    start = time.time()
+    while time.time() - start < duration:
+        t0 = time.time()
+        state['done'] = 0
+        for x in xrange(batch):
+            thread.start_new_thread(noop, ())
+        wait_for(lambda: state['done'] == batch)
+        samples.append((time.time() - t0) / batch)
+        ops += batch
+    seconds = time.time() - start
+    return result(ops, seconds, samples)
+
+def bench_fanout(duration, num=256):
+    """ schedule() num parked coroutines and wait until they all ran """
+    state = { 'hits': 0, 'stop': False, 'parked': 0 }
+    def worker():
+        while True:
+            state['parked'] += 1
+            coev.switch2scheduler()
+            if state['stop']:
+                break
+            state['hits'] += 1
+    workers = [ thread.start_new_thread(worker, ()) for x in xrange(num) ]
+    wait_for(lambda: state['parked'] == num)
+
+    samples = []
+    ops = 0
+    start = time.time()
+    while time.time() - start < duration:
+        t0 = time.time()
+        state['hits'] = 0
+        state['parked'] = 0
+        for tid in workers:
+            coev.schedule(tid)
+        wait_for(lambda: state['parked'] == num)
+        samples.append((time.time() - t0) / num)
+        ops += num
+    seconds = time.time() - start
+    state['stop'] = True
+    for tid in workers:
+        coev.schedule(tid)
+    coev.stall()
+    return result(ops, seconds, samples, num=num)
+
+def bench_pool(duration):
+    """ ConnectionPool get() and release against a local listener """
+    srv = socket.socket()
+    srv.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+    srv.bind(('127.0.0.1', 0))
+    srv.listen(128)
+    srv.setblocking(0)
+    held = []
+    state = { 'stop': False }
+    def acceptor():
+        while not state['stop']:
+            try:
+                coev.wait(srv.fileno(), coev.READ, 0.5)
+            except coev.Timeout:
+                continue
+            held.append(srv.accept()[0])
+    thread.start_new_thread(acceptor, ())
+
+    pool = coev.ConnectionPool(16, 5.0, 2.0, 5.0, 4096, srv.getsockname())
+    samples = []
+    start = time.time()
+    while time.time() - start < duration:
+        t0 = time.time()
+        conn = pool.get()
+        del conn # ConnectionProxy releases on deletion
+        samples.append(time.time() - t0)
+    seconds = time.time() - start
+    state['stop'] = True
+    pool.drop_idle()
+    coev.sleep(0.6)
+    for s in held:
+        s.close()
+    srv.close()
+    return result(len(samples), seconds, samples)
+
+BENCHMARKS = [
+    ('switch', bench_switch, {}),
+    ('throw', bench_throw, {}),
+    ('stall', bench_stall, {}),
+    ('wait_pingpong', bench_wait_pingpong, {}),
+] + [
+    ('readline.{0}'.format(size), bench_readline, { 'size': size }) for size in (16, 128, 1024, 8192)
+] + [
+    ('read.{0}'.format(size), bench_read, { 'size': size }) for size in (512, 4096, 65536)
+] + [
+    ('colock', bench_colock, {}),
+    ('spawn', bench_spawn, {}),
+    ('schedule_fanout', bench_fanout, {}),
+    ('pool', bench_pool, {}),
+]
+
+def stats_delta(before, after):
+    return dict( (k, after[k] - before.get(k, 0)) for k in after
+                    if isinstance(after[k], (int, long)) and after[k] != before.get(k, 0) )
+
+def run(duration, only=None, slowswitch=False):
+    results = {}
+    coev.setfastswitch(not slowswitch)
+    fastswitch = coev.setfastswitch(not slowswitch) # what it came to
+    for name, fn, params in BENCHMARKS:
+        if only and name.split('.')[0] not in only and name not in only:
+            continue
+        before = coev.stats()
+        results[name] = fn(duration, **params)
+        results[name]['stats'] = stats_delta(before, coev.stats())
+        print >>sys.stderr, "{0:20} {1:14.1f} ops/s  p99 {2}".format(name,
+            results[name]['ops_per_sec'], results[name].get('p99', '-'))
+    return {
+        'meta': {
+            'coev': coev.__version__,
+            'python': platform.python_version(),
+            'host': platform.node(),
+            'time': time.time(),
+            'duration': duration,
+            'fastswitch': fastswitch,
+        },
+        'results': results,
+    }
+
+def compare(new, old, threshold):
+    """ prints a comparison table, returns the number of regressions """
+    regressions = 0
+    print "{0:20} {1:>14} {2:>14} {3:>8} {4:>8}".format('benchmark', 'ops/s', 'baseline', 'change', 'p99')
+    for name in sorted(new['results']):
+        if name not in old['results']:
+            continue
+        n, o = new['results'][name], old['results'][name]
+        change = (n['ops_per_sec'] / o['ops_per_sec'] - 1) * 100 if o['ops_per_sec'] else 0.0
+        p99change = ''
+        bad = change < -threshold
+        if n.get('p99') and o.get('p99'):
+            p99pct = (n['p99'] / o['p99'] - 1) * 100
+            p99change = '{0:+.1f}%'.format(p99pct)
+            bad = bad or p99pct > threshold
+        print "{0:20} {1:14.1f} {2:14.1f} {3:+7.1f}% {4:>8} {5}".format(name, n['ops_per_sec'],
+            o['ops_per_sec'], change, p99change, bad and 'REGRESSION' or '')
+        regressions += bad
+    return regressions
+
+def main(pa):
+    rv = 0
+    try:
+        report = run(pa.duration, pa.only and pa.only.split(','), pa.slowswitch)
+        if pa.output:
+            f = open(pa.output, 'w')
+            json.dump(report, f, indent=1, sort_keys=True)
+            f.close()
+        elif not pa.compare:
+            print json.dumps(report, indent=1, sort_keys=True)
+        if pa.compare:
+            f = open(pa.compare)
+            baseline = json.load(f)
+            f.close()
+            rv = compare(report, baseline, pa.threshold) and 1
+    except:
+        import traceback
+        traceback.print_exc()
+        rv = 2
+    os._exit(rv)
+
+if __name__ == "__main__":
+    ap = argparse.ArgumentParser()
+    ap.add_argument('-duration', metavar='seconds', type=float, help='run time of each benchmark', default=2.0)
+    ap.add_argument('-only', metavar='names', help='comma-separated benchmarks to run', default=None)
+    ap.add_argument('-output', metavar='path', help='write JSON results here instead of stdout', default=None)
+    ap.add_argument('-compare', metavar='path', help='compare against baseline JSON results', default=None)
+    ap.add_argument('-threshold', metavar='percent', type=float, help='regression threshold', default=5.0)
+    ap.add_argument('-slowswitch', action='store_true', help='switch without keeping the GIL')
+    pa = ap.parse_args()
+    thread.start_new_thread(main, (pa,))
+    coev.scheduler()
@@ -0,0 +1,201 @@
+import re, zlib, bisect, struct
+
+from coev import ConnectionPool, ProtocolError, RESPError
+
+"""
+memcached (text and binary protocol) and redis clients over ConnectionPool.
+
+    mc = coev.cache.Memcache([('10.0.0.1', 11211), ('10.0.0.2', 11211)])
+    mc.set('k', 'v')
+    mc.get_multi(['k', 'l', 'm'])   # -> {'k': 'v'}
+
+    r = coev.cache.Redis([('10.0.0.3', 6379)])
+    r.execute('SET', 'k', 'v')
+    r.mget(['k', 'l'])              # -> ['v', None]
+
+Keys are spread over endpoints with a consistent hash ring; each
+endpoint has its own ConnectionPool, pool_kwargs go to all of them.
+
+Multi-key operations split keys by endpoint, write the requests to all
+the endpoints involved first and only then read the replies, so N keys
+cost one round trip per endpoint, all of them overlapping. Replies are
+parsed in C straight out of the socketfile buffer: read_mc_values(),
+read_mcbin() and read_resp().
+
+A connection that fails mid-operation is not returned to its pool.
+"""
+
+class Ring(object):
+    """ consistent hashing of keys onto endpoints """
+    def __init__(self, endpoints, replicas=160):
+        points = []
+        for ep in endpoints:
+            for i in xrange(replicas):
+                points.append((zlib.crc32('{0!r}-{1}'.format(ep, i)) & 0xffffffff, ep))
+        points.sort()
+        self.hashes = [ p[0] for p in points ]
+        self.endpoints = [ p[1] for p in points ]
+
+    def get(self, key):
+        i = bisect.bisect(self.hashes, zlib.crc32(key) & 0xffffffff)
+        return self.endpoints[i % len(self.endpoints)]
+
+    def split(self, keys):
+        """ returns {endpoint: [keys]} """
+        rv = {}
+        for key in keys:
+            rv.setdefault(self.get(key), []).append(key)
+        return rv
+
+class ShardedClient(object):
+    def __init__(self, endpoints, conn_limit=64, conn_busy_wait=1.0, conn_timeout=1.0,
+                    iop_timeout=1.0, read_limit=65536):
+        self.pools = dict( (ep, ConnectionPool(conn_limit, conn_busy_wait, conn_timeout,
+                                iop_timeout, read_limit, ep)) for ep in endpoints )
+        self.ring = Ring(endpoints)
+        self.first = endpoints[0]
+
+    def conn(self, key):
+        """ connection to key's endpoint, or to the first one if key is None """
+        if key is None:
+            return self.pools[self.first].get()
+        return self.pools[self.ring.get(key)].get()
+
+    def request(self, key, data, method, *args):
+        """ writes data (a list of strings) to key's endpoint, see conn(),
+            returns method(*args) reply """
+        c = self.conn(key)
+        c.call('writev', data)
+        return c.call(method, *args)
+
+    def batch(self, keys, request, parse):
+        """ for every endpoint involved, writes request(keys) out first,
+            then has parse(proxy, keys) read the reply, in the same order """
+        pending = []
+        try:
+            for ep, eks in self.ring.split(keys).iteritems():
+                c = self.pools[ep].get()
+                pending.append((c, eks))
+                c.call('writev', request(eks))
+            while pending:
+                c, eks = pending[0]
+                parse(c, eks)
+                pending.pop(0)
+        finally:
+            # whatever was not read would be taken for the next reply
+            for c, eks in pending:
+                c.conn.dead = True
+
+_BADKEY = re.compile(r'[\x00-\x20\x7f]')
+
+def check_key(key):
+    if len(key) > 250 or _BADKEY.search(key):
+        raise ValueError("bad memcached key {0!r}".format(key))
+
+# binary protocol
+OP_GET, OP_SET, OP_DELETE, OP_NOOP, OP_GETKQ = 0x00, 0x01, 0x04, 0x0a, 0x0d
+STATUS_OK, STATUS_NOT_FOUND = 0, 1
+
+def mcbin_request(opcode, key='', value='', extras='', opaque=0, cas=0):
+    if len(key) > 250:
+        raise ProtocolError("memcached key is {0} bytes long, 250 at most".format(len(key)))
+    return struct.pack('>BBHBBHIIQ', 0x80, opcode, len(key), len(extras), 0, 0,
+        len(extras) + len(key) + len(value), opaque, cas) + extras + key + value
+
+class Memcache(ShardedClient):
+    """ memcached client; text protocol unless binary=True """
+    def __init__(self, endpoints, binary=False, **pool_kwargs):
+        super(Memcache, self).__init__(endpoints, **pool_kwargs)
+        self.binary = binary
+
+    def get(self, key):
+        return self.get_multi([key]).get(key)
+
+    def get_multi(self, keys):
+        """ returns {key: value} for the keys found """
+        rv = {}
+        if self.binary:
+            def request(eks):
+                return [ mcbin_request(OP_GETKQ, k) for k in eks ] + [ mcbin_request(OP_NOOP) ]
+            def parse(c, eks):
+                for op, status, opaque, cas, extras, key, value in c.call('read_mcbin', OP_NOOP):
+                    if op == OP_GETKQ and status == STATUS_OK:
+                        rv[key] = value
+        else:
+            for k in keys:
+                check_key(k)
+            def request(eks):
+                return [ 'get ', ' '.join(eks), '\r\n' ]
+            def parse(c, eks):
+                for key, flags, value, cas in c.call('read_mc_values'):
+                    rv[key] = value
+        self.batch(keys, request, parse)
+        return rv
+
+    def set(self, key, value, exptime=0, flags=0):
+        if self.binary:
+            reply = self.request(key, [ mcbin_request(OP_SET, key, value, struct.pack('>II', flags, exptime)) ],
+                        'read_mcbin')[0]
+            if reply[1] != STATUS_OK:
+                raise ProtocolError("SET status {0:#x}: {1}".format(reply[1], reply[6]))
+            return
+        check_key(key)
+        reply = self.request(key, [ 'set {0} {1} {2} {3}\r\n'.format(key, flags, exptime, len(value)),
+                    value, '\r\n' ], 'readline')
+        if reply != 'STORED\r\n':
+            raise ProtocolError(reply.rstrip())
+
+    def delete(self, key):
+        """ returns False if there was no such key """
+        if self.binary:
+            status = self.request(key, [ mcbin_request(OP_DELETE, key) ], 'read_mcbin')[0][1]
+            if status not in (STATUS_OK, STATUS_NOT_FOUND):
+                raise ProtocolError("DELETE status {0:#x}".format(status))
+            return status == STATUS_OK
+        check_key(key)
+        reply = self.request(key, [ 'delete ', key, '\r\n' ], 'readline')
+        if reply not in ('DELETED\r\n', 'NOT_FOUND\r\n'):
+            raise ProtocolError(reply.rstrip())
+        return reply == 'DELETED\r\n'
+
+def resp_command(args, out):
+    """ appends a RESP-encoded command to the out list """
+    out.append('*{0}\r\n'.format(len(args)))
+    for a in args:
+        a = str(a)
+        out.extend(('${0}\r\n'.format(len(a)), a, '\r\n'))
+    return out
+
+class Redis(ShardedClient):
+    """ redis client; commands go to the endpoint of their first key,
+        keyless ones (PING, INFO) to the first endpoint """
+    def execute(self, *args):
+        """ execute(command, key, ...) -> reply; error replies are raised """
+        reply = self.request(args[1] if len(args) > 1 else None, resp_command(args, []), 'read_resp')
+        if isinstance(reply, RESPError):
+            raise reply
+        return reply
+
+    def get(self, key):
+        return self.execute('GET', key)
+
+    def set(self, key, value, ex=None):
+        if ex is None:
+            return self.execute('SET', key, value)
+        return self.execute('SET', key, value, 'EX', ex)
+
+    def delete(self, key):
+        return self.execute('DEL', key)
+
+    def mget(self, keys):
+        """ returns values in keys order, None for missing keys """
+        found = {}
+        def request(eks):
+            return resp_command(['MGET'] + eks, [])
+        def parse(c, eks):
+            reply = c.call('read_resp')
+            if isinstance(reply, RESPError):
+                raise reply
+            found.update(zip(eks, reply))
+        self.batch(keys, request, parse)
+        return [ found.get(k) for k in keys ]
@@ -0,0 +1,357 @@
+#!/usr/bin/python
+# -*- encoding: utf-8 -*-
+
+import sys, os, time, json, socket, errno, argparse, resource, thread, collections
+
+import coev
+from coev.prefork import bind_listener
+from coev.bench import percentiles
+
+"""
+local end-to-end load harness: reference servers and an open-loop
+load generator, all coev-based.
+
+    python -m coev.loadtest server -proto http -listen 127.0.0.1:8080
+    python -m coev.loadtest load -proto http -connect 127.0.0.1:8080 \\
+            -connections 20000 -rate 100000 -duration 30
+    python -m coev.loadtest both -proto echo -connections 10000 -rate 50000
+
+Servers accept on a listening socket and spawn a coroutine per
+connection with a small stack (coev.spawn), doing I/O through socketfile.
+echo returns every line it gets; http answers every request with a
+small keep-alive response, and GET /_stats with the server's coev.stats().
+
+The generator opens -connections connections at -ramp per second,
+spread over -sources loopback addresses (127.0.0.1, 127.0.0.2, ...)
+to get past the ephemeral port range, and then sends -rate requests
+per second in total, each connection on a fixed schedule whether or
+not responses keep up (open loop). Latency is measured from the
+scheduled send time, so queueing delay is not hidden.
+
+The report is JSON: throughput, error counts, latency percentiles, and
+coev.stats() deltas of the generator process (and of the server with
+-proto http, via /_stats; 'both' runs them in one process).
+"""
+
+STATS_KEYS = ('c_ctxswaps', 'c_switches', 'c_waits', 'coevs.waiting', 'coevs.used',
+              'cnrbufs.allocated', 'cnrbufs.used', 'stacks.bytes')
+
+def parse_hostport(s):
+    host, port = s.rsplit(':', 1)
+    return (host, int(port))
+
+def raise_nofile():
+    soft, hard = resource.getrlimit(resource.RLIMIT_NOFILE)
+    if soft < hard:
+        resource.setrlimit(resource.RLIMIT_NOFILE, (hard, hard))
+    return hard
+
+def stats_delta(before, after):
+    return dict( (k, after[k] - before.get(k, 0)) for k in STATS_KEYS if k in after )
+
+# servers
+
+class Server(object):
+    def __init__(self, addr, proto, iop_timeout=30.0, rlim=65536, backlog=4096, stack_size=65536):
+        self.addr = addr
+        self.handler = { 'echo': self.echo, 'http': self.http }[proto]
+        self.iop_timeout = iop_timeout
+        self.rlim = rlim
+        self.backlog = backlog
+        self.stack_size = stack_size
+        self.c_accepts = 0
+        self.c_requests = 0
+        self.connections = 0
+
+    def start(self):
+        self.listener = bind_listener(coev.parse_endpoint(self.addr), self.backlog)
+        coev.spawn(self.acceptor)
+        return self.listener.getsockname()
+
+    def acceptor(self):
+        fd = self.listener.fileno()
+        while True:
+            try:
+                coev.wait(fd, coev.READ, 60.0)
+            except coev.Timeout:
+                continue
+            while True:
+                try:
+                    conn, peer = self.listener.accept()
+                except socket.error, e:
+                    if e.errno in (errno.EAGAIN, errno.EINTR, errno.ECONNABORTED):
+                        break
+                    raise
+                conn.setblocking(0)
+                self.c_accepts += 1
+                coev.spawn(self.serve, conn, stack_size=self.stack_size)
+
+    def serve(self, conn):
+        self.connections += 1
+        try:
+            self.handler(conn, coev.socketfile(conn.fileno(), self.iop_timeout, self.rlim))
+        except (coev.SocketError, coev.Timeout):
+            pass
+        finally:
+            self.connections -= 1
+            conn.close()
+
+    def echo(self, conn, sfile):
+        while True:
+            line = sfile.readline()
+            if not line:
+                return
+            self.c_requests += 1
+            sfile.write(line)
+
+    def http(self, conn, sfile):
+        while True:
+            try:
+                head = sfile.read_http_head()
+            except coev.HTTPError:
+                sfile.write('HTTP/1.1 400 Bad Request\r\nContent-Length: 0\r\nConnection: close\r\n\r\n')
+                return
+            if head is None:
+                return
+            method, target, version, headers, length = head
+            if length == -1:
+                while sfile.read_chunk():
+                    pass
+            while length > 0:
+                length -= len(sfile.read(length)) or length
+            close = version == 'HTTP/1.0'
+            for name, value in headers:
+                if name.lower() == 'connection':
+                    close = value.lower() == 'close'
+            self.c_requests += 1
+            if target == '/_stats':
+                body = json.dumps(coev.stats())
+            else:
+                body = 'ok\n'
+            sfile.write('HTTP/1.1 200 OK\r\nContent-Length: {0}\r\nContent-Type: text/plain\r\n\r\n{1}'.format(
+                len(body), body))
+            if close:
+                return
+
+# load generator
+
+ECHO_REQUEST = 'x' * 63 + '\n'
+HTTP_REQUEST = 'GET / HTTP/1.1\r\nHost: loadtest\r\n\r\n'
+
+def read_response(sfile, proto):
+    """ reads one response, returns its body ('' on EOF) """
+    if proto == 'echo':
+        return sfile.readline()
+    head = sfile.read_http_head()
+    if head is None:
+        return ''
+    length = head[4]
+    if length == -1:
+        return ''.join(iter(sfile.read_chunk, ''))
+    if length is None:
+        return ''.join(iter(sfile.read, ''))
+    body = ''
+    while len(body) < length:
+        chunk = sfile.read(length - len(body))
+        if not chunk:
+            break
+        body += chunk
+    return body
+
+def http_get(addr, path, timeout=5.0):
+    s = socket.socket(*coev.parse_endpoint(addr)[:2])
+    s.setblocking(0)
+    try:
+        try:
+            s.connect(addr)
+        except socket.error, e:
+            if e.errno != errno.EINPROGRESS:
+                raise
+            coev.wait(s.fileno(), coev.WRITE, timeout)
+        sfile = coev.socketfile(s.fileno(), timeout, 1 << 20)
+        sfile.write('GET {0} HTTP/1.1\r\nHost: loadtest\r\nConnection: close\r\n\r\n'.format(path))
+        return read_response(sfile, 'http')
+    finally:
+        s.close()
+
+class Generator(object):
+    def __init__(self, addr, proto, connections, rate, duration, ramp=2000.0,
+                    sources=1, iop_timeout=10.0, stack_size=65536):
+        self.addr = addr
+        self.proto = proto
+        self.request = { 'echo': ECHO_REQUEST, 'http': HTTP_REQUEST }[proto]
+        self.nconns = connections
+        self.rate = rate
+        self.duration = duration
+        self.ramp = ramp
+        self.sources = sources
+        self.iop_timeout = iop_timeout
+        self.stack_size = stack_size
+        self.latencies = []
+        self.c_sent = 0
+        self.c_connected = 0
+        self.c_connect_errors = 0
+        self.c_io_errors = 0
+        self.c_late = 0 # requests sent behind schedule
+        self.alive = 0
+
+    def connect(self, n):
+        family = coev.parse_endpoint(self.addr)[0]
+        s = socket.socket(family, socket.SOCK_STREAM)
+        s.setblocking(0)
+        try:
+            if family == socket.AF_INET and self.sources > 1:
+                s.bind(('127.0.0.{0}'.format(1 + n % self.sources), 0))
+            try:
+                s.connect(self.addr)
+            except socket.error, e:
+                if e.errno != errno.EINPROGRESS:
+                    raise
+                coev.wait(s.fileno(), coev.WRITE, self.iop_timeout)
+                err = s.getsockopt(socket.SOL_SOCKET, socket.SO_ERROR)
+                if err:
+                    raise socket.error(err, os.strerror(err))
+        except:
+            s.close()
+            raise
+        return s
+
+    def connection(self, n, start, end):
+        """ sends on schedule from start to end; a spawned receiver matches responses,
+            and closes the socket: it may be waiting on it when we are done """
+        try:
+            s = self.connect(n)
+        except (socket.error, coev.Timeout):
+            self.c_connect_errors += 1
+            return
+        self.c_connected += 1
+        self.alive += 1
+        interval = self.nconns / float(self.rate)
+        wfile = coev.socketfile(s.fileno(), self.iop_timeout, 4096)
+        state = { 'pending': collections.deque(), 'done': False, 'reading': True }
+        coev.spawn(self.receiver, s, state, stack_size=self.stack_size)
+        # spread connections evenly over the interval
+        due = max(start, time.time()) + interval * n / self.nconns
+        try:
+            while due < end and state['reading']:
+                now = time.time()
+                if due > now:
+                    coev.sleep(due - now)
+                elif now - due > interval:
+                    self.c_late += 1
+                state['pending'].append(due)
+                wfile.write(self.request)
+                self.c_sent += 1
+                due += interval
+        except (coev.SocketError, coev.Timeout):
+            self.c_io_errors += 1
+        state['done'] = True
+        while state['reading'] and state['pending'] and time.time() < end + self.iop_timeout:
+            coev.sleep(0.05)
+        try:
+            s.shutdown(socket.SHUT_WR)
+        except socket.error:
+            pass
+
+    def receiver(self, s, state):
+        rfile = coev.socketfile(s.fileno(), self.iop_timeout, 65536)
+        try:
+            while not (state['done'] and not state['pending']):
+                if not read_response(rfile, self.proto):
+                    break
+                if state['pending']:
+                    self.latencies.append(time.time() - state['pending'].popleft())
+        except (coev.SocketError, coev.Timeout, coev.HTTPError):
+            if not state['done']:
+                self.c_io_errors += 1
+        state['reading'] = False
+        # the sender stops writing once it sees that
+        while not state['done']:
+            coev.sleep(0.05)
+        s.close()
+        self.alive -= 1
+
+    def run(self, server_stats=None):
+        before = coev.stats()
+        if server_stats:
+            sbefore = server_stats()
+        ramp_time = self.nconns / self.ramp
+        start = time.time() + ramp_time
+        end = start + self.duration
+        for n in xrange(self.nconns):
+            coev.spawn(self.connection, n, start, end, stack_size=self.stack_size)
+            if n % 100 == 99:
+                coev.sleep(100 / self.ramp)
+        coev.sleep(max(0, start - time.time()))
+        wait_start = time.time()
+        coev.sleep(self.duration)
+        # let the tail of responses come in
+        while self.alive and time.time() < end + self.iop_timeout + 1:
+            coev.sleep(0.1)
+        seconds = time.time() - wait_start
+
+        lat = percentiles(self.latencies)
+        report = {
+            'proto': self.proto,
+            'connections': self.nconns,
+            'connected': self.c_connected,
+            'connect_errors': self.c_connect_errors,
+            'io_errors': self.c_io_errors,
+            'target_rate': self.rate,
+            'sent': self.c_sent,
+            'late': self.c_late,
+            'completed': len(self.latencies),
+            'throughput': len(self.latencies) / self.duration,
+            'seconds': seconds,
+            'latency': lat,
+            'stats': stats_delta(before, coev.stats()),
+        }
+        if server_stats:
+            report['server_stats'] = stats_delta(sbefore, server_stats())
+        return report
+
+def main(pa):
+    rv = 0
+    try:
+        raise_nofile()
+        if pa.mode in ('server', 'both'):
+            server = Server(parse_hostport(pa.listen), pa.proto)
+            addr = server.start()
+            print >>sys.stderr, "{0} server on {1}:{2}".format(pa.proto, addr[0], addr[1])
+            if pa.mode == 'server':
+                while True:
+                    coev.sleep(10)
+                    print >>sys.stderr, "connections {0} requests {1}".format(
+                        server.connections, server.c_requests)
+        else:
+            addr = parse_hostport(pa.connect)
+
+        server_stats = None
+        if pa.mode == 'load' and pa.proto == 'http':
+            server_stats = lambda: json.loads(http_get(addr, '/_stats'))
+
+        gen = Generator(addr, pa.proto, pa.connections, pa.rate, pa.duration,
+                pa.ramp, pa.sources, pa.timeout)
+        report = gen.run(server_stats)
+        print json.dumps(report, indent=1, sort_keys=True)
+    except:
+        import traceback
+        traceback.print_exc()
+        rv = 1
+    os._exit(rv)
+
+if __name__ == "__main__":
+    ap = argparse.ArgumentParser()
+    ap.add_argument('mode', choices=('server', 'load', 'both'))
+    ap.add_argument('-proto', choices=('echo', 'http'), default='http')
+    ap.add_argument('-listen', metavar='host:port', default='127.0.0.1:0', help='server address')
+    ap.add_argument('-connect', metavar='host:port', default='127.0.0.1:8080', help='address to load')
+    ap.add_argument('-connections', type=int, default=10000)
+    ap.add_argument('-rate', type=float, default=50000.0, help='total requests per second')
+    ap.add_argument('-duration', type=float, default=10.0, metavar='seconds')
+    ap.add_argument('-ramp', type=float, default=2000.0, help='new connections per second')
+    ap.add_argument('-sources', type=int, default=1, help='loopback source addresses to spread over')
+    ap.add_argument('-timeout', type=float, default=10.0, help='per-operation timeout')
+    pa = ap.parse_args()
+    thread.start_new_thread(main, (pa,))
+    coev.scheduler()
@@ -0,0 +1,280 @@
+import os, sys, time, errno, signal, select, socket, json, thread, logging
+
+import _coev
+from coev import parse_endpoint
+
+"""
+pre-forking multi-process supervisor.
+
+coev.scheduler() drives one event loop on one core. To use more cores,
+listening sockets are set up once, then nworkers copies of the process
+are forked, each running its own scheduler:
+
+    def setup(listeners):
+        for l in listeners:
+            thread.start_new_thread(acceptor, (l,))
+
+    coev.prefork(8, setup, [('0.0.0.0', 8080)])
+
+listen_addrs are in the same formats as ConnectionPool endpoints.
+Listeners are either bound in the supervisor before forking and inherited
+by all workers, or, with reuseport=True, bound by each worker separately
+with SO_REUSEPORT, letting the kernel spread connections.
+
+prefork() must be called from the main coroutine, before scheduler() is run.
+_coev is initialized at import time, so the children come out of fork()
+through PyOS_AfterFork() -> coev_fork_notify() like any forked coev process.
+
+Each worker writes its stats() as a JSON line into a socketpair every
+report_interval seconds; the supervisor keeps the last report per worker,
+see Supervisor.stats(). Counters (c_* keys) are totalled over the workers
+that exited as well, so totals don't go back on a restart; what was
+counted after a worker's last report is lost. Workers that exit are
+restarted, those that die sooner than min_uptime seconds after start -
+with a restart_delay pause.
+
+SIGTERM, SIGINT or Supervisor.stop() shut the workers down.
+"""
+
+SO_REUSEPORT = getattr(socket, 'SO_REUSEPORT', 15) # linux value, py2 socket lacks it
+
+def bind_listener(endpoint, backlog=1024, reuseport=False):
+    """ binds and listens a non-blocking socket for an (AF, TYPE, addr) endpoint """
+    s = socket.socket(endpoint[0], endpoint[1])
+    try:
+        if endpoint[0] != socket.AF_UNIX:
+            s.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+            if reuseport:
+                s.setsockopt(socket.SOL_SOCKET, SO_REUSEPORT, 1)
+        s.bind(endpoint[2])
+        s.listen(backlog)
+        s.setblocking(0)
+    except:
+        s.close()
+        raise
+    return s
+
+def _counter(key):
+    return key.rsplit('.', 1)[-1].startswith('c_')
+
+def _additive(key):
+    return _counter(key) or 'bytes' in key.split('.')
+
+class Worker(object):
+    """ supervisor-side worker record """
+    def __init__(self, slot, pid, sock):
+        self.slot = slot
+        self.pid = pid
+        self.sock = sock
+        self.started = time.time()
+        self.inbuf = ''
+        self.stats = {}
+
+    def __repr__(self):
+        return "Worker(slot={0} pid={1})".format(self.slot, self.pid)
+
+class Supervisor(object):
+    def __init__(self, nworkers, setup, listen_addrs, reuseport=False, backlog=1024,
+                    report_interval=1.0, min_uptime=1.0, restart_delay=1.0,
+                    stop_timeout=10.0, on_report=None):
+        self.el = logging.getLogger('coev.prefork')
+        self.nworkers = nworkers
+        self.setup = setup
+        self.endpoints = [ parse_endpoint(ep) for ep in listen_addrs ]
+        self.reuseport = reuseport
+        self.backlog = backlog
+        self.report_interval = report_interval
+        self.min_uptime = min_uptime
+        self.restart_delay = restart_delay
+        self.stop_timeout = stop_timeout
+        self.on_report = on_report
+        self.listeners = []
+        self.workers = {} # pid -> Worker
+        self.restart_at = {} # slot -> time
+        self.stopping = False
+        self.c_restarts = 0
+        self.retired = {} # counters of workers that exited
+
+    def stop(self, *args):
+        self.stopping = True
+
+    def stats(self):
+        """ returns {'workers': {pid: stats}, 'total': {key: sum}}
+
+        total has counters, summed over all workers ever run, and byte
+        counts, summed over the current ones. Gauges that don't add up
+        (hwm, latencies, states, slot, uptime) are only in workers.
+        """
+        total = dict(self.retired)
+        per_worker = {}
+        for w in self.workers.itervalues():
+            per_worker[w.pid] = w.stats
+            for k, v in w.stats.iteritems():
+                if _additive(k) and isinstance(v, (int, long, float)):
+                    total[k] = total.get(k, 0) + v
+        total['prefork.workers'] = len(self.workers)
+        total['prefork.c_restarts'] = self.c_restarts
+        return { 'workers': per_worker, 'total': total }
+
+    def run(self):
+        if not self.reuseport:
+            self.listeners = [ bind_listener(ep, self.backlog) for ep in self.endpoints ]
+
+        prev_term = signal.signal(signal.SIGTERM, self.stop)
+        prev_int = signal.signal(signal.SIGINT, self.stop)
+        try:
+            for slot in xrange(self.nworkers):
+                self.spawn(slot)
+            while not self.stopping:
+                self.poll(self.report_interval)
+                self.reap()
+                self.respawn()
+        finally:
+            signal.signal(signal.SIGTERM, prev_term)
+            signal.signal(signal.SIGINT, prev_int)
+            self.shutdown()
+
+    def spawn(self, slot):
+        ours, theirs = socket.socketpair(socket.AF_UNIX, socket.SOCK_STREAM)
+        pid = os.fork()
+        if pid == 0:
+            ours.close()
+            for w in self.workers.itervalues():
+                w.sock.close()
+            self._worker(slot, theirs)
+            # not reached
+        theirs.close()
+        ours.setblocking(0)
+        self.workers[pid] = Worker(slot, pid, ours)
+        self.el.info("started worker slot %d pid %d", slot, pid)
+
+    def poll(self, timeout):
+        socks = [ w.sock for w in self.workers.itervalues() ]
+        try:
+            readable = select.select(socks, [], [], timeout)[0]
+        except select.error, e:
+            if e[0] == errno.EINTR:
+                return
+            raise
+        for w in self.workers.values():
+            if w.sock not in readable:
+                continue
+            try:
+                data = w.sock.recv(65536)
+            except socket.error, e:
+                if e.errno in (errno.EAGAIN, errno.EINTR):
+                    continue
+                data = ''
+            if not data:
+                continue # worker is gone; reap() will tell
+            w.inbuf += data
+            while '\n' in w.inbuf:
+                line, w.inbuf = w.inbuf.split('\n', 1)
+                try:
+                    w.stats = json.loads(line)
+                except ValueError:
+                    self.el.error("garbled report from %r", w)
+        if readable and self.on_report:
+            self.on_report(self.stats())
+
+    def reap(self):
+        while self.workers:
+            try:
+                pid, status = os.waitpid(-1, os.WNOHANG)
+            except OSError, e:
+                if e.errno == errno.EINTR:
+                    continue
+                if e.errno == errno.ECHILD:
+                    break
+                raise
+            if pid == 0:
+                break
+            w = self.workers.pop(pid, None)
+            if w is None:
+                continue
+            w.sock.close()
+            for k, v in w.stats.iteritems():
+                if _counter(k) and isinstance(v, (int, long, float)):
+                    self.retired[k] = self.retired.get(k, 0) + v
+            if self.stopping:
+                continue
+            self.el.error("worker slot %d pid %d exited with status %#x", w.slot, w.pid, status)
+            self.c_restarts += 1
+            if time.time() - w.started < self.min_uptime:
+                self.restart_at[w.slot] = time.time() + self.restart_delay
+            else:
+                self.restart_at[w.slot] = 0
+
+    def respawn(self):
+        now = time.time()
+        for slot, when in self.restart_at.items():
+            if when <= now and not self.stopping:
+                del self.restart_at[slot]
+                self.spawn(slot)
+
+    def shutdown(self):
+        for w in self.workers.itervalues():
+            try:
+                os.kill(w.pid, signal.SIGTERM)
+            except OSError:
+                pass
+        deadline = time.time() + self.stop_timeout
+        while self.workers and time.time() < deadline:
+            self.reap()
+            time.sleep(0.05)
+        for w in self.workers.itervalues():
+            self.el.error("worker slot %d pid %d did not stop, killing", w.slot, w.pid)
+            try:
+                os.kill(w.pid, signal.SIGKILL)
+                os.waitpid(w.pid, 0)
+            except OSError:
+                pass
+            w.sock.close()
+        self.workers = {}
+        for l in self.listeners:
+            l.close()
+        self.listeners = []
+
+    def _worker(self, slot, sock):
+        """ runs in the child; never returns """
+        signal.signal(signal.SIGTERM, signal.SIG_DFL)
+        signal.signal(signal.SIGINT, signal.SIG_IGN)
+        rv = 0
+        try:
+            if self.reuseport:
+                self.listeners = [ bind_listener(ep, self.backlog, True) for ep in self.endpoints ]
+            thread.start_new_thread(self._worker_main, (slot, sock))
+            _coev.scheduler()
+        except:
+            self.el.exception("worker slot %d pid %d", slot, os.getpid())
+            rv = 1
+        os._exit(rv)
+
+    def _worker_main(self, slot, sock):
+        try:
+            self.setup(self.listeners)
+        except:
+            self.el.exception("worker slot %d pid %d: setup failed", slot, os.getpid())
+            os._exit(1)
+        started = time.time()
+        sock.setblocking(0)
+        sfile = _coev.socketfile(sock.fileno(), self.report_interval, 4096)
+        while True:
+            _coev.sleep(self.report_interval)
+            report = _coev.stats()
+            report['prefork.slot'] = slot
+            report['prefork.uptime'] = time.time() - started
+            try:
+                sfile.write(json.dumps(report) + '\n')
+            except (_coev.SocketError, _coev.Timeout):
+                # supervisor is gone
+                os._exit(1)
+
+def prefork(nworkers, setup, listen_addrs, **kwargs):
+    """ prefork(nworkers, setup, listen_addrs, **kwargs) -> None
+
+    runs a Supervisor until SIGTERM or SIGINT; see Supervisor for kwargs.
+    setup(listeners) is called in a new coroutine of each worker with
+    a list of listening sockets, in listen_addrs order.
+    """
+    Supervisor(nworkers, setup, listen_addrs, **kwargs).run()
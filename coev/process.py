@@ -0,0 +1,215 @@
+import os, time, errno, fcntl, socket, select, signal, subprocess
+
+import _coev
+
+"""
+coroutine-aware child processes.
+
+    p = coev.Process(['gzip', '-c'], stdin=PIPE, stdout=PIPE)
+    out, err = p.communicate(data, timeout=5.0)
+
+subprocess.Popen.communicate() and os.waitpid() would block the whole
+scheduler. Process starts children through Popen, but with stdio
+redirected into socketpairs, since socketfile writes with send(), which
+does not work on pipes. The parent ends are non-blocking and available
+as socketfile objects: p.stdin, p.stdout, p.stderr - for streaming use;
+communicate() reads the raw sockets itself, so don't mix the two.
+
+Exit is waited for with a pidfd (Linux 5.3+) through the event loop.
+Without pidfd support wait() polls waitpid(WNOHANG) with a backoff from
+1 to 100 ms: signalfd needs SIGCHLD blocked in every thread, and
+signal.set_wakeup_fd() belongs to the application, so neither is usable
+from a library. Thousands of children can be waited for at once either
+way, each by its own coroutine.
+
+Timeouts raise coev.Timeout; the child is left running, communicate()
+can be called again and continues where it stopped.
+"""
+
+PIPE = subprocess.PIPE
+STDOUT = subprocess.STDOUT
+
+_pidfd_works = [ True ]
+
+def _cloexec(fd):
+    fcntl.fcntl(fd, fcntl.F_SETFD, fcntl.fcntl(fd, fcntl.F_GETFD) | fcntl.FD_CLOEXEC)
+
+class Process(object):
+    def __init__(self, args, stdin=None, stdout=None, stderr=None, iop_timeout=60.0, rlim=65536,
+                    **popen_kwargs):
+        """ popen_kwargs go to subprocess.Popen; stdin, stdout, stderr are as there. """
+        self.socks = {}
+        theirs = {}
+        redirect = {}
+        for name, spec in (('stdin', stdin), ('stdout', stdout), ('stderr', stderr)):
+            if spec == PIPE:
+                ours, theirs[name] = socket.socketpair(socket.AF_UNIX, socket.SOCK_STREAM)
+                ours.setblocking(0)
+                _cloexec(ours.fileno())
+                self.socks[name] = ours
+                redirect[name] = theirs[name].fileno()
+            else:
+                redirect[name] = spec
+        popen_kwargs.update(redirect)
+        try:
+            self.popen = subprocess.Popen(args, **popen_kwargs)
+        except:
+            for s in self.socks.itervalues():
+                s.close()
+            raise
+        finally:
+            for s in theirs.itervalues():
+                s.close()
+
+        self.pid = self.popen.pid
+        self.returncode = None
+        self.stdin = self.stdout = self.stderr = None
+        for name, s in self.socks.iteritems():
+            setattr(self, name, _coev.socketfile(s.fileno(), iop_timeout, rlim))
+        self.pidfd = None
+        if _pidfd_works[0]:
+            try:
+                self.pidfd = _coev.pidfd_open(self.pid)
+            except OSError, e:
+                if e.errno in (errno.ENOSYS, errno.EPERM, errno.EINVAL):
+                    _pidfd_works[0] = False
+                else:
+                    raise
+        self.comm = None
+
+    def __repr__(self):
+        return "Process(pid={0} returncode={1})".format(self.pid, self.returncode)
+
+    def poll(self):
+        """ returns the exit code, or None if the child is still running """
+        if self.returncode is None:
+            try:
+                pid, status = os.waitpid(self.pid, os.WNOHANG)
+            except OSError, e:
+                if e.errno != errno.ECHILD:
+                    raise
+                pid, status = self.pid, 0 # reaped elsewhere, as subprocess assumes
+            if pid == self.pid:
+                if os.WIFSIGNALED(status):
+                    self.returncode = -os.WTERMSIG(status)
+                else:
+                    self.returncode = os.WEXITSTATUS(status)
+                self.popen.returncode = self.returncode
+                self._close_pidfd()
+        return self.returncode
+
+    def wait(self, timeout=None):
+        """ returns the exit code once the child exits """
+        deadline = None if timeout is None else time.time() + timeout
+        delay = 0.001
+        while self.poll() is None:
+            remaining = 3600.0 if deadline is None else deadline - time.time()
+            if remaining <= 0:
+                raise _coev.Timeout("process {0} is still running".format(self.pid))
+            if self.pidfd is not None:
+                try:
+                    _coev.wait(self.pidfd, _coev.READ, remaining)
+                except _coev.Timeout:
+                    pass
+            else:
+                _coev.sleep(min(delay, remaining))
+                delay = min(delay * 2, 0.1)
+        return self.returncode
+
+    def communicate(self, input=None, timeout=None):
+        """ feeds input to stdin, then closes it, reads stdout and stderr
+            until EOF and waits for the child to exit.
+            returns (stdout data, stderr data), None for those not piped.
+        """
+        deadline = None if timeout is None else time.time() + timeout
+        if self.comm is None:
+            self.comm = { 'input': input or '', 'pos': 0, 'stdout': [], 'stderr': [] }
+        comm = self.comm
+
+        ep = select.epoll()
+        open_fds = {}
+        try:
+            for name, s in self.socks.items():
+                if s is None:
+                    continue
+                if name == 'stdin':
+                    if comm['pos'] >= len(comm['input']):
+                        self._close_stream('stdin')
+                        continue
+                    ep.register(s.fileno(), select.EPOLLOUT)
+                else:
+                    ep.register(s.fileno(), select.EPOLLIN)
+                open_fds[s.fileno()] = name
+
+            while open_fds:
+                events = ep.poll(0)
+                if not events:
+                    remaining = 3600.0 if deadline is None else deadline - time.time()
+                    if remaining <= 0:
+                        raise _coev.Timeout("process {0}: communicate() timed out".format(self.pid))
+                    try:
+                        _coev.wait(ep.fileno(), _coev.READ, remaining)
+                    except _coev.Timeout:
+                        pass
+                    continue
+                for fd, ev in events:
+                    name = open_fds[fd]
+                    s = self.socks[name]
+                    try:
+                        if name == 'stdin':
+                            pos = comm['pos']
+                            comm['pos'] += s.send(buffer(comm['input'], pos, 65536))
+                            done = comm['pos'] >= len(comm['input'])
+                        else:
+                            data = s.recv(65536)
+                            comm[name].append(data)
+                            done = not data
+                    except socket.error, e:
+                        if e.errno in (errno.EAGAIN, errno.EINTR):
+                            continue
+                        if e.errno not in (errno.EPIPE, errno.ECONNRESET):
+                            raise
+                        done = True
+                    if done:
+                        ep.unregister(fd)
+                        del open_fds[fd]
+                        self._close_stream(name)
+        finally:
+            ep.close()
+
+        self.wait(None if deadline is None else max(0, deadline - time.time()))
+        return tuple( ''.join(comm[name]) if name in self.socks else None
+                        for name in ('stdout', 'stderr') )
+
+    def send_signal(self, sig):
+        if self.returncode is None:
+            os.kill(self.pid, sig)
+
+    def terminate(self):
+        self.send_signal(signal.SIGTERM)
+
+    def kill(self):
+        self.send_signal(signal.SIGKILL)
+
+    def _close_stream(self, name):
+        s = self.socks.get(name)
+        if s is not None:
+            s.close()
+            self.socks[name] = None
+            setattr(self, name, None)
+
+    def _close_pidfd(self):
+        if self.pidfd is not None:
+            os.close(self.pidfd)
+            self.pidfd = None
+
+    def close(self):
+        """ closes the parent ends of the stdio sockets and the pidfd """
+        for name in self.socks.keys():
+            self._close_stream(name)
+        self._close_pidfd()
+
+    def __del__(self):
+        # an unwaited-for Popen is reaped by subprocess itself later on
+        if getattr(self, 'pidfd', None) is not None:
+            self._close_pidfd()
@@ -0,0 +1,202 @@
+import os, stat, time, json, errno, socket
+
+import _coev
+
+"""
+zero-downtime restarts: listening sockets, and idle upstream connections,
+handed over to a successor process with SCM_RIGHTS.
+
+in the old process, say on SIGHUP:
+
+    coev.handoff('/run/app.handoff', [listener], pools=[db_pool],
+        on_listen=lambda: coev.Process([sys.executable] + sys.argv))
+    server.stop()
+    coev.drain(lambda: server.connections, 30.0)
+    os._exit(0)
+
+in the new one, before binding anything:
+
+    adopted = coev.adopt('/run/app.handoff')
+    if adopted:
+        listener = adopted.listeners[0]
+        db_pool.adopt(adopted.connections)
+    else:
+        listener = bind_listener(...)
+
+The successor gets the very same listening sockets, not copies bound
+anew: both processes accept from one backlog until the old one stops,
+so no connection attempt is refused or lost, and the kernel socket
+lives on as long as either holds it. handoff() returns once adopt()
+has confirmed it got everything; then the old process only has to
+stop accepting and let its coroutines finish under a deadline, see
+drain(). Upstream connections are passed only if idle in their pool at
+the time, and are not used by the old process after that.
+
+handoff() listens on unix_path and has to be there before adopt()
+looks: adopt() returns None right away if no one is, so that a first
+start does not wait. Hence on_listen, to start the successor from.
+The transfer is over SOCK_SEQPACKET, one JSON description per message
+with up to 253 fds attached, see send_fds() and recv_fds().
+"""
+
+MAX_FDS = 253
+MSG_SIZE = 1 << 20
+
+class Adopted(object):
+    """ what adopt() returns """
+    def __init__(self):
+        self.listeners = []
+        self.connections = [] # (endpoint, socket)
+
+    def __repr__(self):
+        return "Adopted(listeners={0} connections={1})".format(len(self.listeners), len(self.connections))
+
+def _remaining(deadline):
+    rv = deadline - time.time()
+    if rv <= 0:
+        raise _coev.Timeout("handoff: deadline passed")
+    return rv
+
+def _unlink_socket(path):
+    try:
+        if stat.S_ISSOCK(os.stat(path).st_mode):
+            os.unlink(path)
+    except OSError, e:
+        if e.errno != errno.ENOENT:
+            raise
+
+def handoff(unix_path, listeners, pools=(), timeout=60.0, on_listen=None):
+    """ handoff(unix_path, listeners, pools=(), timeout=60.0, on_listen=None) -> int
+
+    waits up to timeout seconds for adopt() at unix_path, passes it the
+    listeners and the idle connections of pools (ConnectionPool objects)
+    and returns the number of sockets passed. on_listen() is called once
+    adopt() can connect.
+    """
+    deadline = time.time() + timeout
+    _unlink_socket(unix_path)
+    srv = socket.socket(socket.AF_UNIX, socket.SOCK_SEQPACKET)
+    taken = [ (pool, pool.available) for pool in pools ]
+    for pool in pools:
+        pool.available = []
+    try:
+        srv.bind(unix_path)
+        srv.listen(1)
+        srv.setblocking(0)
+        if on_listen is not None:
+            on_listen()
+        while True:
+            try:
+                conn, _ = srv.accept()
+                break
+            except socket.error, e:
+                if e.errno not in (errno.EAGAIN, errno.EINTR):
+                    raise
+            _coev.wait(srv.fileno(), _coev.READ, _remaining(deadline))
+        conn.setblocking(0)
+        try:
+            items = [ ({ 'kind': 'listener', 'family': l.family, 'type': l.type }, l)
+                        for l in listeners ]
+            for pool, conns in taken:
+                items.extend( ({ 'kind': 'connection', 'endpoint': c.endpoint,
+                                 'family': c.sock.family, 'type': c.sock.type }, c.sock)
+                                for c in conns )
+            i = 0
+            while True:
+                batch = items[i:i + MAX_FDS]
+                i += MAX_FDS
+                msg = json.dumps({ 'items': [ b[0] for b in batch ], 'more': i < len(items) })
+                _coev.send_fds(conn.fileno(), msg, [ b[1].fileno() for b in batch ], _remaining(deadline))
+                if i >= len(items):
+                    break
+            reply, fds = _coev.recv_fds(conn.fileno(), 4096, _remaining(deadline))
+            for fd in fds:
+                os.close(fd)
+            if reply != 'adopted':
+                raise _coev.ProtocolError("handoff: successor replied {0!r}".format(reply))
+        finally:
+            conn.close()
+    except:
+        for pool, conns in taken:
+            pool.available.extend(conns)
+        raise
+    finally:
+        srv.close()
+        _unlink_socket(unix_path)
+    for pool, conns in taken:
+        for c in conns:
+            c.close()
+    return len(items)
+
+def _str(v):
+    return v.encode('utf-8') if isinstance(v, unicode) else v
+
+def _endpoint(ep):
+    """ back from JSON into the parse_endpoint() form """
+    af, type_, addr = ep
+    if isinstance(addr, list):
+        return (af, type_, tuple(_str(v) for v in addr))
+    return (af, type_, _str(addr))
+
+def adopt(unix_path, timeout=10.0):
+    """ adopt(unix_path, timeout=10.0) -> Adopted or None
+
+    takes over what handoff() at unix_path passes: .listeners in the order
+    handoff() got them, .connections as (endpoint, socket) for
+    ConnectionPool.adopt(). All sockets are non-blocking. Returns None
+    if no one is handing off at unix_path.
+    """
+    deadline = time.time() + timeout
+    s = socket.socket(socket.AF_UNIX, socket.SOCK_SEQPACKET)
+    try:
+        s.setblocking(0)
+        while True:
+            try:
+                s.connect(unix_path)
+                break
+            except socket.error, e:
+                if e.errno in (errno.ENOENT, errno.ECONNREFUSED):
+                    return None
+                if e.errno not in (errno.EAGAIN, errno.EINTR):
+                    raise
+            _coev.sleep(min(0.01, _remaining(deadline)))
+        rv = Adopted()
+        more = True
+        while more:
+            data, fds = _coev.recv_fds(s.fileno(), MSG_SIZE, _remaining(deadline))
+            try:
+                if not data:
+                    raise _coev.ProtocolError("handoff: peer went away")
+                msg = json.loads(data)
+                if len(msg['items']) != len(fds):
+                    raise _coev.ProtocolError("handoff: {0} items but {1} fds".format(
+                        len(msg['items']), len(fds)))
+                for item in msg['items']:
+                    sock = socket.fromfd(fds[0], item['family'], item['type'])
+                    os.close(fds.pop(0))
+                    sock.setblocking(0)
+                    if item['kind'] == 'listener':
+                        rv.listeners.append(sock)
+                    else:
+                        rv.connections.append((_endpoint(item['endpoint']), sock))
+            finally:
+                for fd in fds:
+                    os.close(fd)
+            more = msg['more']
+        _coev.send_fds(s.fileno(), 'adopted', [], _remaining(deadline))
+        return rv
+    finally:
+        s.close()
+
+def drain(active, timeout, interval=0.05):
+    """ drain(active, timeout, interval=0.05) -> int
+
+    waits until active() returns 0, say the number of connections still
+    being served, or timeout seconds pass; returns what active() said last.
+    """
+    deadline = time.time() + timeout
+    while True:
+        n = active()
+        if not n or time.time() >= deadline:
+            return n
+        _coev.sleep(interval)
@@ -0,0 +1,135 @@
+import sys, struct, json
+
+"""
+reader for coev.trace_dump() files and a converter to the Chrome trace
+event format, viewable in chrome://tracing or ui.perfetto.dev:
+
+    coev.trace_start()
+    ...
+    coev.trace_dump('/tmp/coev.trace')
+
+    python -m coev.trace /tmp/coev.trace /tmp/coev.json
+
+Every coroutine gets its own track, named by its treepos if it was 
+alive at dump time. Time it ran between switches is shown as 'run' 
+slices, waits, sleeps and socketfile I/O as async slices spanning the
+switches, schedule() and stall() as instant events.
+"""
+
+HEADER = struct.Struct('=8sIIQQ')
+EVENT = struct.Struct('=QQQII')
+NAME = struct.Struct('=QI')
+
+SWITCH_OUT, SWITCH_IN, SCHEDULE, WAIT_START, WAIT_END, \
+    READ_START, READ_END, WRITE_START, WRITE_END = range(1, 10)
+
+class TraceFormatError(Exception):
+    pass
+
+def load(path):
+    """ returns (events, names, dropped); events are (ts, coev, arg, type, arg2) tuples, 
+        names map coev to treepos """
+    f = open(path, 'rb')
+    try:
+        data = f.read()
+    finally:
+        f.close()
+    if len(data) < HEADER.size:
+        raise TraceFormatError("{0}: truncated header".format(path))
+    magic, evsize, nnames, count, dropped = HEADER.unpack_from(data, 0)
+    if magic != 'COEVTRC1' or evsize != EVENT.size:
+        raise TraceFormatError("{0}: not a coev trace dump".format(path))
+    pos = HEADER.size
+    if len(data) < pos + count * EVENT.size:
+        raise TraceFormatError("{0}: truncated events".format(path))
+    events = [ EVENT.unpack_from(data, pos + i * EVENT.size) for i in xrange(count) ]
+    pos += count * EVENT.size
+    names = {}
+    for i in xrange(nnames):
+        coev, length = NAME.unpack_from(data, pos)
+        pos += NAME.size
+        names[coev] = data[pos:pos + length]
+        pos += length
+    return events, names, dropped
+
+def to_chrome(events, names):
+    """ returns a Chrome trace event format dict """
+    out = []
+    tids = {}
+    running = {}    # coev -> ts of its switch in
+    pending = {}    # coev -> (name, ts, args) of its wait or I/O
+    seq = [0]
+    if events:
+        t0 = events[0][0]
+    else:
+        t0 = 0
+
+    def us(ts):
+        return (ts - t0) / 1000.0
+
+    def tid(coev):
+        if coev not in tids:
+            tids[coev] = len(tids) + 1
+            out.append({ 'ph': 'M', 'name': 'thread_name', 'pid': 1, 'tid': tids[coev],
+                'args': { 'name': '[{0}] {1:#x}'.format(names.get(coev, '?'), coev) } })
+        return tids[coev]
+
+    def begin_async(coev, ts, name, args):
+        pending[coev] = (name, ts, args)
+
+    def end_async(coev, ts, args):
+        if coev not in pending:
+            return
+        name, start, bargs = pending.pop(coev)
+        seq[0] += 1
+        bargs.update(args)
+        out.append({ 'ph': 'b', 'cat': 'io', 'name': name, 'id': seq[0], 
+            'pid': 1, 'tid': tid(coev), 'ts': us(start), 'args': bargs })
+        out.append({ 'ph': 'e', 'cat': 'io', 'name': name, 'id': seq[0], 
+            'pid': 1, 'tid': tid(coev), 'ts': us(ts) })
+
+    for ts, coev, arg, typ, arg2 in events:
+        if typ == SWITCH_IN:
+            running[coev] = ts
+        elif typ == SWITCH_OUT:
+            if coev in running:
+                start = running.pop(coev)
+                out.append({ 'ph': 'X', 'cat': 'run', 'name': 'run', 'pid': 1, 'tid': tid(coev),
+                    'ts': us(start), 'dur': (ts - start) / 1000.0,
+                    'args': { 'to': '{0:#x}'.format(arg) if arg else 'scheduler' } })
+        elif typ == SCHEDULE:
+            out.append({ 'ph': 'i', 's': 't', 'cat': 'sched', 'name': 'schedule', 
+                'pid': 1, 'tid': tid(coev), 'ts': us(ts), 
+                'args': { 'target': '{0:#x}'.format(arg) } })
+        elif typ == WAIT_START:
+            if arg == 0xffffffffffffffff:
+                begin_async(coev, ts, 'sleep', {})
+            else:
+                begin_async(coev, ts, 'wait', { 'fd': arg, 'events': arg2 })
+        elif typ in (READ_START, WRITE_START):
+            begin_async(coev, ts, typ == READ_START and 'read' or 'write', { 'fd': arg })
+        elif typ == WAIT_END:
+            end_async(coev, ts, { 'status': arg2 })
+        elif typ in (READ_END, WRITE_END):
+            if arg == 0xffffffffffffffff:
+                end_async(coev, ts, { 'errno': arg2 })
+            else:
+                end_async(coev, ts, { 'bytes': arg })
+    return { 'traceEvents': out, 'displayTimeUnit': 'ns' }
+
+def convert(inpath, outpath):
+    events, names, dropped = load(inpath)
+    trace = to_chrome(events, names)
+    trace['otherData'] = { 'dropped': dropped }
+    f = open(outpath, 'w')
+    try:
+        json.dump(trace, f)
+    finally:
+        f.close()
+    return len(events)
+
+if __name__ == "__main__":
+    if len(sys.argv) != 3:
+        print >>sys.stderr, "usage: {0} dump.trace out.json".format(sys.argv[0])
+        sys.exit(1)
+    print "{0} events converted".format(convert(sys.argv[1], sys.argv[2]))
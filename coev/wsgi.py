@@ -0,0 +1,520 @@
+import sys, time, socket, errno, urllib, logging, collections
+
+import coev
+from coev.prefork import bind_listener
+
+"""
+keep-alive, pipelining WSGI server.
+
+    def app(environ, start_response):
+        start_response('200 OK', [('Content-Type', 'text/plain')])
+        return ['hello\n']
+
+    coev.wsgi.run(app, ('0.0.0.0', 8080))
+
+or, to run inside an already running scheduler, e.g. in a prefork setup:
+
+    def setup(listeners):
+        coev.wsgi.WSGIServer(app, listener=listeners[0]).start()
+
+    coev.prefork(8, setup, [('0.0.0.0', 8080)])
+
+Each connection gets its own coroutine (coev.spawn, stack_size sized),
+which reads request heads with socketfile.read_http_head() and serves
+them in order for as long as the client keeps the connection open,
+so pipelined requests are answered back to back out of the read buffer.
+
+Responses are gathered - status line, headers and body strings - and
+sent with socketfile.writev() once write_buffer bytes pile up or the
+response is complete. Bodies without Content-Length go out chunked to
+HTTP/1.1 clients, unless the application returns a list or tuple, whose
+length is then known up front.
+
+rlim and iop_timeout are passed to each connection's socketfile, so
+iop_timeout also limits the keep-alive idle time. head_limit caps
+request heads, max_body caps Content-Length and chunked bodies (413).
+At max_connections no more connections are accepted until some close;
+they wait in the listen backlog.
+
+With shed=True requests are answered with 503 and the connection is
+closed while coev.overloaded() says the scheduler can't keep up, see
+coev.setoverload(). A probe coroutine sleeping probe_interval at a time
+is started so that queueing delay is measured even when nothing else
+sleeps or stalls; it also calls the setoverload() hook, if any.
+
+stop() makes the server stop accepting and close connections once their
+current request is answered, e.g. after coev.handoff() passed the
+listener on; wsgi.connections tells when they are all gone. Keep-alive
+connections idle between requests are closed right away, with
+shutdown(SHUT_RD): a request already received is still served, one
+that crosses the close is for the client to retry, as it would be on
+any keep-alive connection closing.
+
+stats() returns coev.stats() with request counts and latency
+percentiles of the last latency_window requests under 'wsgi.' keys.
+"""
+
+RESPONSES = {
+    400: '400 Bad Request',
+    413: '413 Request Entity Too Large',
+    500: '500 Internal Server Error',
+    503: '503 Service Unavailable',
+}
+
+class BodyTooLarge(Exception):
+    pass
+
+class Input(object):
+    """ wsgi.input: the request body, Content-Length delimited or chunked """
+    def __init__(self, sfile, length, max_body=None, continue_cb=None):
+        self.sfile = sfile
+        self.remaining = length # -1 for chunked
+        self.max_body = max_body
+        self.continue_cb = continue_cb
+        self.buf = ''
+        self.total = 0
+
+    def _fill(self):
+        """ chunked: buffers one more chunk, returns False at the end """
+        if self.remaining != -1:
+            return False
+        if self.continue_cb:
+            self.continue_cb()
+            self.continue_cb = None
+        chunk = self.sfile.read_chunk()
+        if not chunk:
+            self.remaining = 0
+            return False
+        self.total += len(chunk)
+        if self.max_body is not None and self.total > self.max_body:
+            raise BodyTooLarge(self.total)
+        self.buf += chunk
+        return True
+
+    def _read_fixed(self, size):
+        if self.continue_cb:
+            self.continue_cb()
+            self.continue_cb = None
+        parts = []
+        size = min(size, self.remaining)
+        while size > 0:
+            data = self.sfile.read(size)
+            if not data:
+                raise coev.SocketError(errno.ECONNRESET, "EOF in request body")
+            parts.append(data)
+            size -= len(data)
+            self.remaining -= len(data)
+        return ''.join(parts)
+
+    def read(self, size=-1):
+        if size is None or size < 0:
+            if self.remaining == -1:
+                while self._fill():
+                    pass
+                data, self.buf = self.buf, ''
+                return data
+            return self._read_fixed(self.remaining)
+        if self.remaining == -1 or self.buf:
+            while len(self.buf) < size and self._fill():
+                pass
+            data, self.buf = self.buf[:size], self.buf[size:]
+            return data
+        return self._read_fixed(size)
+
+    def readline(self, size=-1):
+        if self.remaining == -1 or self.buf:
+            while '\n' not in self.buf and (size < 0 or len(self.buf) < size) and self._fill():
+                pass
+            end = self.buf.find('\n') + 1 or len(self.buf)
+            if size >= 0:
+                end = min(end, size)
+            data, self.buf = self.buf[:end], self.buf[end:]
+            return data
+        if self.remaining == 0:
+            return ''
+        if self.continue_cb:
+            self.continue_cb()
+            self.continue_cb = None
+        hint = self.remaining if size < 0 else min(size, self.remaining)
+        data = self.sfile.readline(hint)
+        if not data:
+            raise coev.SocketError(errno.ECONNRESET, "EOF in request body")
+        self.remaining -= len(data)
+        return data
+
+    def readlines(self, hint=None):
+        return list(self)
+
+    def __iter__(self):
+        return iter(self.readline, '')
+
+    def drain(self):
+        """ skips whatever the application did not read; unread 100-continue bodies are not sent """
+        if self.continue_cb:
+            return False
+        self.buf = ''
+        if self.remaining == -1:
+            while self.sfile.read_chunk():
+                pass
+        while self.remaining > 0:
+            self._read_fixed(min(self.remaining, 65536))
+        return True
+
+class HTTPConnection(object):
+    """ serves requests on one accepted connection """
+    def __init__(self, server, sock, peer):
+        self.server = server
+        self.sock = sock
+        self.peer = peer
+        self.sfile = coev.socketfile(sock.fileno(), server.iop_timeout, server.rlim)
+
+    def serve(self):
+        server = self.server
+        idle = False
+        while True:
+            if idle:
+                server.idle.add(self)
+            try:
+                head = self.sfile.read_http_head(server.head_limit)
+            except coev.HTTPError, e:
+                server.c_bad_requests += 1
+                self.error(400, str(e))
+                return
+            finally:
+                server.idle.discard(self)
+            if head is None:
+                return
+            if isinstance(head[1], int): # a status line, not a request line
+                server.c_bad_requests += 1
+                self.error(400, 'not a request')
+                return
+            if server.shed and coev.overloaded():
+                server.c_shed += 1
+                self.error(503, 'overloaded')
+                return
+            started = time.time()
+            keepalive = self.request(*head)
+            server.account(time.time() - started)
+            if not keepalive or server.stopping:
+                return
+            idle = True
+
+    def wake(self):
+        """ makes read_http_head() see EOF once what is already received is read """
+        try:
+            self.sock.shutdown(socket.SHUT_RD)
+        except socket.error:
+            pass
+
+    def error(self, code, msg=''):
+        body = msg + '\n'
+        self.sfile.write('HTTP/1.1 {0}\r\nContent-Type: text/plain\r\nContent-Length: {1}\r\n'
+                'Connection: close\r\n\r\n{2}'.format(RESPONSES[code], len(body), body))
+
+    def environ(self, method, target, version, headers, length):
+        server = self.server
+        path, _, query = target.partition('?')
+        env = {
+            'REQUEST_METHOD': method,
+            'SCRIPT_NAME': '',
+            'PATH_INFO': urllib.unquote(path),
+            'QUERY_STRING': query,
+            'SERVER_NAME': server.server_name,
+            'SERVER_PORT': server.server_port,
+            'SERVER_PROTOCOL': version,
+            'REMOTE_ADDR': self.peer[0] if isinstance(self.peer, tuple) else '',
+            'REMOTE_PORT': str(self.peer[1]) if isinstance(self.peer, tuple) else '',
+            'wsgi.version': (1, 0),
+            'wsgi.url_scheme': 'http',
+            'wsgi.errors': sys.stderr,
+            'wsgi.multithread': True,
+            'wsgi.multiprocess': server.multiprocess,
+            'wsgi.run_once': False,
+        }
+        for name, value in headers:
+            if '_' in name:
+                continue # would be indistinguishable from its '-' twin
+            key = name.upper().replace('-', '_')
+            if key == 'CONTENT_TYPE' or key == 'CONTENT_LENGTH':
+                env[key] = value
+                continue
+            key = 'HTTP_' + key
+            if key in env:
+                env[key] += ',' + value
+            else:
+                env[key] = value
+        if length == -1:
+            env.pop('HTTP_TRANSFER_ENCODING', None)
+        return env
+
+    def request(self, method, target, version, headers, length):
+        """ serves one request, returns False if the connection is to be closed """
+        server = self.server
+        server.c_requests += 1
+        if server.max_body is not None and length > server.max_body:
+            server.c_bad_requests += 1
+            self.error(413)
+            return False
+
+        env = self.environ(method, target, version, headers, length)
+        conn = env.get('HTTP_CONNECTION', '').lower()
+        if version == 'HTTP/1.1':
+            self.keepalive = 'close' not in conn
+        else:
+            self.keepalive = 'keep-alive' in conn
+        if server.stopping:
+            self.keepalive = False
+        continue_cb = None
+        if length and version == 'HTTP/1.1' and env.get('HTTP_EXPECT', '').lower() == '100-continue':
+            continue_cb = lambda: self.sfile.write('HTTP/1.1 100 Continue\r\n\r\n')
+        inp = Input(self.sfile, length, server.max_body, continue_cb)
+        env['wsgi.input'] = inp
+
+        self.version = version
+        self.head_only = method == 'HEAD'
+        self.status = None
+        self.headers = None
+        self.headers_sent = False
+        self.chunked = False
+        self.length_header = False
+        self.out = []
+        self.outlen = 0
+        self.length = None
+
+        result = None
+        try:
+            result = server.app(env, self.start_response)
+            if isinstance(result, (list, tuple)) and self.length is None and not self.headers_sent:
+                self.length = sum(len(s) for s in result)
+            for data in result:
+                if data:
+                    self.write(data)
+            self.finish()
+        except (coev.SocketError, coev.Timeout, coev.HTTPError):
+            return False
+        except BodyTooLarge:
+            server.c_bad_requests += 1
+            if not self.headers_sent:
+                self.error(413)
+            return False
+        except:
+            server.c_errors += 1
+            server.el.exception("%s %s", method, target)
+            if not self.headers_sent:
+                try:
+                    self.error(500)
+                except (coev.SocketError, coev.Timeout):
+                    pass
+            return False
+        finally:
+            if hasattr(result, 'close'):
+                result.close()
+        if not self.keepalive:
+            return False
+        try:
+            return inp.drain()
+        except (coev.SocketError, coev.Timeout, coev.HTTPError, BodyTooLarge):
+            return False
+
+    def start_response(self, status, headers, exc_info=None):
+        if exc_info:
+            try:
+                if self.headers_sent:
+                    raise exc_info[0], exc_info[1], exc_info[2]
+            finally:
+                exc_info = None
+        elif self.status is not None:
+            raise AssertionError("start_response() called twice")
+        self.status = status
+        self.headers = headers
+        for name, value in headers:
+            if name.lower() == 'content-length':
+                self.length = int(value)
+                self.length_header = True
+        return self.write
+
+    def send_headers(self):
+        code = int(self.status[:3])
+        bodyless = self.head_only or code in (204, 304) or code < 200
+        hl = [ 'HTTP/1.1 ', self.status, '\r\n' ]
+        for name, value in self.headers:
+            hl.extend((name, ': ', value, '\r\n'))
+        if self.length is None and not bodyless:
+            if self.version == 'HTTP/1.1':
+                self.chunked = True
+                hl.append('Transfer-Encoding: chunked\r\n')
+            else:
+                self.keepalive = False
+        if self.length is not None and not self.length_header and (self.head_only or not bodyless):
+            hl.extend(('Content-Length: ', str(self.length), '\r\n'))
+        if not self.keepalive:
+            hl.append('Connection: close\r\n')
+        elif self.version != 'HTTP/1.1':
+            hl.append('Connection: keep-alive\r\n')
+        hl.append('\r\n')
+        self.out.append(''.join(hl))
+        self.outlen += len(self.out[-1])
+        self.headers_sent = True
+        self.bodyless = bodyless
+
+    def write(self, data):
+        if self.status is None:
+            raise AssertionError("write() before start_response()")
+        if not self.headers_sent:
+            self.send_headers()
+        if self.bodyless:
+            return
+        if self.chunked:
+            self.out.extend(('{0:x}\r\n'.format(len(data)), data, '\r\n'))
+        else:
+            self.out.append(data)
+        self.outlen += len(data)
+        if self.outlen >= self.server.write_buffer:
+            self.flush()
+
+    def flush(self):
+        if self.out:
+            self.sfile.writev(self.out)
+            self.out = []
+            self.outlen = 0
+
+    def finish(self):
+        if self.status is None:
+            raise AssertionError("application returned without calling start_response()")
+        if not self.headers_sent:
+            if self.length is None and not self.head_only:
+                self.length = 0
+            self.send_headers()
+        if self.chunked:
+            self.out.append('0\r\n\r\n')
+        self.flush()
+
+class WSGIServer(object):
+    def __init__(self, app, listen_addr=None, listener=None, max_connections=10000,
+                    iop_timeout=30.0, rlim=65536, head_limit=65536, max_body=None,
+                    write_buffer=65536, backlog=1024, stack_size=coev.DEFAULT_STACK_SIZE,
+                    latency_window=10000, multiprocess=False, shed=False, probe_interval=0.01):
+        self.el = logging.getLogger('coev.wsgi')
+        self.app = app
+        if listener is None:
+            listener = bind_listener(coev.parse_endpoint(listen_addr), backlog)
+        self.listener = listener
+        addr = listener.getsockname()
+        if isinstance(addr, tuple):
+            self.server_name, self.server_port = addr[0], str(addr[1])
+        else:
+            self.server_name, self.server_port = addr, ''
+        self.max_connections = max_connections
+        self.iop_timeout = iop_timeout
+        self.rlim = rlim
+        self.head_limit = head_limit
+        self.max_body = max_body
+        self.write_buffer = write_buffer
+        self.stack_size = stack_size
+        self.multiprocess = multiprocess
+        self.shed = shed
+        self.probe_interval = probe_interval
+        self.latencies = collections.deque(maxlen=latency_window)
+        self.connections = 0
+        self.connections_hwm = 0
+        self.c_accepts = 0
+        self.c_cap_pauses = 0
+        self.c_requests = 0
+        self.c_responses = 0
+        self.c_bad_requests = 0
+        self.c_errors = 0
+        self.c_shed = 0
+        self.latency_sum = 0.0
+        self.stopping = False
+        self.idle = set() # keep-alive connections waiting for their next request
+
+    def start(self):
+        """ spawns the acceptor coroutine; the scheduler must be or get running """
+        coev.spawn(self.acceptor)
+        if self.shed:
+            coev.spawn(self.probe, stack_size=self.stack_size)
+
+    def probe(self):
+        """ its timer lateness is what overloaded() is decided on; calls the
+        setoverload() hook, which may log, so it gets a full stack """
+        while True:
+            coev.try_sleep(self.probe_interval)
+            coev.overloaded()
+
+    def stop(self):
+        """ stops accepting within a second; connections close after their current
+        request, idle keep-alive ones right away """
+        self.stopping = True
+        for conn in list(self.idle):
+            conn.wake()
+
+    def acceptor(self):
+        fd = self.listener.fileno()
+        while not self.stopping:
+            if self.connections >= self.max_connections:
+                self.c_cap_pauses += 1
+                while self.connections >= self.max_connections:
+                    coev.sleep(0.01)
+            if coev.try_wait(fd, coev.READ, 1.0) != coev.IO_OK:
+                continue
+            while self.connections < self.max_connections and not self.stopping:
+                try:
+                    sock, peer = self.listener.accept()
+                except socket.error, e:
+                    if e.errno in (errno.EAGAIN, errno.EINTR, errno.ECONNABORTED):
+                        break
+                    if e.errno in (errno.EMFILE, errno.ENFILE):
+                        self.el.error("accept(): %s", e)
+                        coev.sleep(0.1)
+                        break
+                    raise
+                sock.setblocking(0)
+                self.c_accepts += 1
+                self.connections += 1
+                self.connections_hwm = max(self.connections_hwm, self.connections)
+                coev.spawn(self.connection, sock, peer, stack_size=self.stack_size)
+
+    def connection(self, sock, peer):
+        try:
+            HTTPConnection(self, sock, peer).serve()
+        except (coev.SocketError, coev.Timeout):
+            pass
+        except:
+            self.el.exception("connection from %r", peer)
+        finally:
+            self.connections -= 1
+            sock.close()
+
+    def account(self, seconds):
+        self.c_responses += 1
+        self.latency_sum += seconds
+        self.latencies.append(seconds)
+
+    def stats(self):
+        rv = coev.stats()
+        rv['wsgi.connections'] = self.connections
+        rv['wsgi.connections.hwm'] = self.connections_hwm
+        rv['wsgi.connections.max'] = self.max_connections
+        rv['wsgi.c_accepts'] = self.c_accepts
+        rv['wsgi.c_cap_pauses'] = self.c_cap_pauses
+        rv['wsgi.c_requests'] = self.c_requests
+        rv['wsgi.c_responses'] = self.c_responses
+        rv['wsgi.c_bad_requests'] = self.c_bad_requests
+        rv['wsgi.c_errors'] = self.c_errors
+        rv['wsgi.c_shed'] = self.c_shed
+        rv['wsgi.latency.mean'] = self.latency_sum / self.c_responses if self.c_responses else 0.0
+        window = sorted(self.latencies)
+        for name, q in (('p50', 0.5), ('p90', 0.9), ('p99', 0.99), ('p999', 0.999)):
+            rv['wsgi.latency.' + name] = window[min(len(window) - 1, int(q * len(window)))] if window else 0.0
+        rv['wsgi.latency.max'] = window[-1] if window else 0.0
+        return rv
+
+def run(app, listen_addr, **kwargs):
+    """ run(app, listen_addr, **kwargs) -> never returns
+
+    serves app with a WSGIServer (see it for kwargs) in this process;
+    must be called from the main coroutine, instead of coev.scheduler().
+    """
+    server = WSGIServer(app, listen_addr, **kwargs)
+    server.start()
+    coev.scheduler()
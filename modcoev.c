@@ -1,9 +1,22 @@
 #define PY_SSIZE_T_CLEAN
 #include "Python.h"
 #include "pythread.h"
+#include "frameobject.h"
 
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <time.h>
+#include <signal.h>
+
+#if defined(__linux__) && !defined(SYS_pidfd_open) && !defined(__alpha__)
+#define SYS_pidfd_open 434  /* same on all the rest; older headers lack it */
+#endif
 
 #include "ucoev.h"
 
@@ -38,6 +51,9 @@ static time_t start_time;
 #define PyVarObject_HEAD_INIT(type, size) PyObject_HEAD_INIT(type) size,
 #endif
 
+/* statuses of the try_ calls, besides errno values */
+#define IO_OK 0
+#define IO_EOF -1
 
 static struct _const_def { 
     const char *name;
@@ -45,6 +61,8 @@ static struct _const_def {
 } _const_tab[] = {
     { "READ", COEV_READ },
     { "WRITE", COEV_WRITE },
+    { "IO_OK", IO_OK },
+    { "IO_EOF", IO_EOF },
     { "CDF_COEV", CDF_COEV },
     { "CDF_COEV_DUMP", CDF_COEV_DUMP},
     { "CDF_RUNQ_DUMP", CDF_RUNQ_DUMP},
@@ -72,6 +90,9 @@ static PyObject* PyExc_CoroTargetDead;
 static PyObject* PyExc_CoroTargetBusy;
 
 static PyObject* PyExc_CoroSocketError;
+static PyObject* PyExc_CoroProtocolError;
+static PyObject* PyExc_CoroHTTPError;
+static PyObject* PyExc_CoroRESPError;
 
 static struct _exc_def {
     PyObject **exc;
@@ -125,6 +146,21 @@ static struct _exc_def {
         "coev.SocketError", "SocketError",
         "ask Captain Obvious\n"
     },
+    {
+        &PyExc_CoroProtocolError, &PyExc_ValueError,
+        "coev.ProtocolError", "ProtocolError",
+        "malformed or unexpected reply from the other side\n"
+    },
+    {
+        &PyExc_CoroHTTPError, &PyExc_CoroProtocolError,
+        "coev.HTTPError", "HTTPError",
+        "malformed or ambiguous HTTP message head or chunked framing\n"
+    },
+    {
+        &PyExc_CoroRESPError, &PyExc_Exception,
+        "coev.RESPError", "RESPError",
+        "error reply from a redis server\n"
+    },
     
     { 0 }
 };
@@ -132,6 +168,613 @@ static struct _exc_def {
 #define coro_dprintf(fmt, args...) do { if (debug_flag) \
     coev_dmprintf(fmt, ## args); } while(0)
 
+/** per-coroutine module records.
+
+    coev_t has no room for module data, so records are kept in an
+    open-addressed table keyed by coev_t pointer. Since libucoev pools
+    and reuses coev_t structures, a record is tagged with coev_t::id
+    and is reset once it turns out to belong to an earlier incarnation.
+    The table never shrinks, being bounded by coevs.allocated anyway.
+
+    Records are allocated separately and never move, but don't hold on
+    to one across a switch: look it up again after coming back.
+**/
+
+typedef struct _coro_rec {
+    coev_t *coev;
+    unsigned long id;
+    int resumable;      /* switched out through switch_out() */
+    uint64_t cputime;   /* ns spent between switch_in() and switch_out() */
+    uint64_t sched_mark;/* when it was put on the runqueue, if by this module */
+    size_t stack_size;  /* as told by setstacksize(), 0 if unknown */
+    size_t stack_top;   /* highest and lowest stack pointers seen in switch_out() */
+    size_t stack_low;
+    uint64_t since;     /* last switch_in() or switch_out() */
+    int wait_fd;        /* what it waits for, as told by wait_note() */
+    int wait_events;
+    struct _local_slots *locals; /* coev.local values, owned by the thread state dict */
+} coro_rec_t;
+
+static coro_rec_t **crtab;
+static size_t crtab_size;   /* power of 2 */
+static size_t crtab_used;
+static coro_rec_t *crcache; /* record of the current coroutine as of last lookup */
+
+#define CRTAB_SLOT(c, size) ((((size_t)(c)) >> 4) * 2654435761u & ((size) - 1))
+
+static void
+coro_rec_reset(coro_rec_t *rec) {
+    coev_t *c = rec->coev;
+
+    memset(rec, 0, sizeof(coro_rec_t));
+    rec->coev = c;
+    rec->id = c->id;
+}
+
+static int
+crtab_grow(void) {
+    coro_rec_t **newtab;
+    size_t i, j, newsize = crtab_size ? crtab_size * 2 : 256;
+
+    newtab = PyMem_Malloc(newsize * sizeof(coro_rec_t *));
+    if (!newtab)
+        return -1;
+    memset(newtab, 0, newsize * sizeof(coro_rec_t *));
+    for (i = 0; i < crtab_size; i++) {
+        if (!crtab[i])
+            continue;
+        j = CRTAB_SLOT(crtab[i]->coev, newsize);
+        while (newtab[j])
+            j = (j + 1) & (newsize - 1);
+        newtab[j] = crtab[i];
+    }
+    PyMem_Free(crtab);
+    crtab = newtab;
+    crtab_size = newsize;
+    return 0;
+}
+
+/* record for c, or NULL if there's none yet */
+static coro_rec_t *
+coro_rec_find(coev_t *c) {
+    size_t i;
+
+    if (!crtab_size)
+        return NULL;
+    for (i = CRTAB_SLOT(c, crtab_size); crtab[i]; i = (i + 1) & (crtab_size - 1)) {
+        if (crtab[i]->coev == c) {
+            if (crtab[i]->id != c->id)
+                coro_rec_reset(crtab[i]);
+            return crtab[i];
+        }
+    }
+    return NULL;
+}
+
+/* record for c, created if needed; NULL if out of memory. Does not set exception. */
+static coro_rec_t *
+coro_rec(coev_t *c) {
+    coro_rec_t *rec;
+    size_t i;
+
+    if ((rec = coro_rec_find(c)))
+        return rec;
+    if ((crtab_used + 1) * 2 > crtab_size && crtab_grow())
+        return NULL;
+    if (!(rec = PyMem_Malloc(sizeof(coro_rec_t))))
+        return NULL;
+    rec->coev = c;
+    coro_rec_reset(rec);
+
+    for (i = CRTAB_SLOT(c, crtab_size); crtab[i]; i = (i + 1) & (crtab_size - 1));
+    crtab[i] = rec;
+    crtab_used++;
+    return rec;
+}
+
+/* does rec describe a live incarnation of its coev_t */
+static int
+coro_rec_live(coro_rec_t *rec) {
+    return rec->id == rec->coev->id && rec->coev->state != CSTATE_DEAD;
+}
+
+static coro_rec_t *
+coro_rec_current(void) {
+    coev_t *cur = coev_current();
+
+    if (crcache && crcache->coev == cur && crcache->id == cur->id)
+        return crcache;
+    return crcache = coro_rec(cur);
+}
+
+/** CPU hold time accounting.
+
+    The time between a coroutine's switch_in() and its next switch_out()
+    is charged to it, monotonic clock. Nothing else runs on the thread
+    meanwhile, so this is the time it kept coev_loop() and everyone
+    else waiting. The first and the last run of a coroutine do not pass
+    through either; starter(), which coev.spawn() starts coroutines
+    with, accounts for them. Resumption from a lock wait happens inside
+    libucoev and is not seen.
+
+    The watchdog is a POSIX timer armed for the threshold at the start
+    of every hold and disarmed at its end, which costs two syscalls per
+    switch while it is on. When it fires, the signal handler copies the
+    Python stack of the coroutine still running into the next hog slot,
+    the way faulthandler does: no allocation, no Python code, strings
+    truncated and the innermost HOG_DEPTH frames only. Pending calls
+    can't be used instead, Python runs them in the root coroutine only.
+    If a hold outlasts the threshold without the timer having caught it,
+    the stack where the hold ended is copied instead. Slots are only
+    turned into Python objects by hogs().
+
+    A blocking call that outlasts the threshold in the hogging coroutine
+    gets the signal, and fails with EINTR unless it is restarted.
+**/
+
+#define HOGS_MAX 64
+#define HOG_DEPTH 24
+#define HOG_FILE_LEN 80     /* tail of the filename is kept */
+#define HOG_NAME_LEN 40
+#define HOG_TREEPOS_LEN 64
+
+typedef struct {
+    long id;
+    double held;
+    int depth;              /* innermost frame first */
+    char treepos[HOG_TREEPOS_LEN];
+    struct {
+        int lineno;
+        char filename[HOG_FILE_LEN];
+        char name[HOG_NAME_LEN];
+    } frames[HOG_DEPTH];
+} hog_t;
+
+static coro_rec_t *hold_rec;    /* who has been running since hold_mark */
+static PyThreadState *hold_ts;  /* and its thread state */
+static uint64_t hold_mark;
+static uint64_t watchdog_ns;
+static timer_t watchdog_timer;
+static int watchdog_signo;      /* 0 until the timer is created */
+static volatile sig_atomic_t hog_caught; /* slot hog_next is filled for this hold */
+
+/* hog_next is where the next record goes, the hog_count before it are kept */
+static hog_t hogs_ring[HOGS_MAX + 1];
+static int hog_next;
+static int hog_count;
+
+static uint64_t
+now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static PyObject *
+py_stack(PyFrameObject *f) {
+    PyObject *stack, *entry;
+
+    if (!(stack = PyList_New(0)))
+        return NULL;
+    for (; f; f = f->f_back) {
+        entry = Py_BuildValue("(OiO)", f->f_code->co_filename,
+                PyCode_Addr2Line(f->f_code, f->f_lasti), f->f_code->co_name);
+        if (!entry || PyList_Append(stack, entry)) {
+            Py_XDECREF(entry);
+            Py_DECREF(stack);
+            return NULL;
+        }
+        Py_DECREF(entry);
+    }
+    PyList_Reverse(stack);
+    return stack;
+}
+
+/* signal-safe: copies, truncating, the tail or the head of a string object */
+static void
+hog_strcpy(char *dst, size_t size, PyObject *s, int tail) {
+    const char *src = "?";
+    size_t len = 1;
+
+    if (s && PyString_Check(s)) {
+        src = PyString_AS_STRING(s);
+        len = PyString_GET_SIZE(s);
+    }
+    if (len >= size) {
+        if (tail)
+            src += len - (size - 1);
+        len = size - 1;
+    }
+    memcpy(dst, src, len);
+    dst[len] = 0;
+}
+
+/* signal-safe */
+static void
+hog_capture(hog_t *hog, PyFrameObject *f) {
+    int depth;
+
+    for (depth = 0; f && depth < HOG_DEPTH; f = f->f_back, depth++) {
+        hog->frames[depth].lineno = PyCode_Addr2Line(f->f_code, f->f_lasti);
+        hog_strcpy(hog->frames[depth].filename, HOG_FILE_LEN, f->f_code->co_filename, 1);
+        hog_strcpy(hog->frames[depth].name, HOG_NAME_LEN, f->f_code->co_name, 0);
+    }
+    hog->depth = depth;
+}
+
+static void
+watchdog_signal(int signo) {
+    int err = errno;
+
+    if (hold_rec && hold_ts && !hog_caught) {
+        hog_capture(&hogs_ring[hog_next], hold_ts->frame);
+        hog_caught = 1;
+    }
+    errno = err;
+}
+
+static void
+watchdog_arm(uint64_t ns) {
+    struct itimerspec its;
+
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_sec = ns / 1000000000ULL;
+    its.it_value.tv_nsec = ns % 1000000000ULL;
+    timer_settime(watchdog_timer, 0, &its, NULL);
+}
+
+/* the hold is over: into the ring, with the stack where it ended if 
+   the timer missed it */
+static void
+hog_report(coro_rec_t *self, uint64_t held) {
+    hog_t *hog = &hogs_ring[hog_next];
+    const char *treepos = coev_treepos(self->coev);
+
+    if (!hog_caught) {
+        hog_caught = 1;
+        hog_capture(hog, hold_ts ? hold_ts->frame : NULL);
+    }
+    hog->id = (long)self->coev;
+    hog->held = held / 1e9;
+    strncpy(hog->treepos, treepos ? treepos : "", HOG_TREEPOS_LEN - 1);
+    hog->treepos[HOG_TREEPOS_LEN - 1] = 0;
+    hog_next = (hog_next + 1) % (HOGS_MAX + 1);
+    if (hog_count < HOGS_MAX)
+        hog_count++;
+}
+
+/** latency histograms.
+
+    Fixed log-linear buckets, 4 per power of two of nanoseconds, as in
+    HDR histograms with 2 bits of precision: a sample goes in with a
+    couple of instructions and a counter increment, and reported
+    percentiles are within 25% of the truth.
+
+    Only what passes through this module is seen: libucoev does not
+    expose its loop iterations and lock waits.
+**/
+
+#define HIST_BUCKETS 256
+
+typedef struct {
+    const char *name;
+    uint64_t count;
+    uint64_t sum;
+    uint64_t min;
+    uint64_t max;
+    uint64_t buckets[HIST_BUCKETS];
+} histogram_t;
+
+enum {
+    HIST_HOLD,          /* switch_in() to switch_out() */
+    HIST_RUNQ,          /* schedule(), stall() or a sleep()/wait() timer to switch_in() */
+    HIST_WAIT_EVENT,    /* wait() or socketfile I/O that got its event */
+    HIST_WAIT_TIMEOUT,  /* same, timed out */
+    HIST_COUNT
+};
+
+static histogram_t histograms[HIST_COUNT] = {
+    { "hold" }, { "runq_delay" }, { "wait.event" }, { "wait.timeout" }
+};
+
+static int
+hist_bucket(uint64_t v) {
+    int msb;
+
+    if (v < 4)
+        return (int)v;
+    msb = 63 - __builtin_clzll(v);
+    return msb * 4 + (int)((v >> (msb - 2)) & 3);
+}
+
+/* upper bound of bucket b, ns */
+static uint64_t
+hist_bucket_top(int b) {
+    if (b < 4)
+        return b;
+    return ((uint64_t)(5 + (b & 3)) << (b / 4 - 2)) - 1;
+}
+
+static void
+hist_add(histogram_t *h, uint64_t v) {
+    h->buckets[hist_bucket(v)]++;
+    if (!h->count || v < h->min)
+        h->min = v;
+    if (v > h->max)
+        h->max = v;
+    h->count++;
+    h->sum += v;
+}
+
+/** admission control.
+
+    CoDel applied to coroutines: the queueing delays that go into the
+    runq_delay histogram also drive a controller. Once every delay seen
+    for a whole interval was above target, the process is overloaded,
+    until a delay below target is seen, or none at all for a while.
+    overloaded() is what servers check before taking on new work. The
+    state changes in switch_in(), where no Python code can be run, so
+    the hook, if set, is called from the next overloaded() instead.
+**/
+
+static struct {
+    uint64_t target;        /* ns; 0 disables */
+    uint64_t interval;
+    uint64_t first_above;   /* when delays above target will have lasted an interval */
+    uint64_t last_sample;
+    uint64_t last_delay;
+    uint64_t c_overloads;
+    int overloaded;
+    int notified;           /* state the hook was last called with */
+    int in_hook;
+    PyObject *hook;
+} overload = { 5000000, 100000000 };
+
+/* calls the hook if the state changed since it was last called; 
+   from overloaded() only: the hook may switch */
+static void
+overload_notify(void) {
+    PyObject *hook, *rv;
+
+    if (!overload.hook || overload.in_hook || overload.notified == overload.overloaded)
+        return;
+    overload.in_hook = 1;
+    overload.notified = overload.overloaded;
+    hook = overload.hook;
+    Py_INCREF(hook);
+    rv = PyObject_CallFunction(hook, "(Od)", overload.overloaded ? Py_True : Py_False,
+            overload.last_delay / 1e9);
+    if (rv)
+        Py_DECREF(rv);
+    else
+        PyErr_WriteUnraisable(hook);
+    Py_DECREF(hook);
+    overload.in_hook = 0;
+}
+
+static void
+overload_sample(uint64_t now, uint64_t delay) {
+    int was = overload.overloaded;
+
+    overload.last_sample = now;
+    overload.last_delay = delay;
+    if (!overload.target)
+        return;
+    if (delay < overload.target) {
+        overload.first_above = 0;
+        overload.overloaded = 0;
+    } else if (!overload.first_above)
+        overload.first_above = now + overload.interval;
+    else if (now >= overload.first_above)
+        overload.overloaded = 1;
+    if (overload.overloaded != was)
+        overload.c_overloads += overload.overloaded;
+}
+
+/* no delays seen for an interval, plus the last delay, which also spaces
+   them out: nothing queues */
+static int
+overload_check(uint64_t now) {
+    if (overload.overloaded 
+            && now - overload.last_sample > overload.interval + overload.last_delay) {
+        overload.overloaded = 0;
+        overload.first_above = 0;
+    }
+    return overload.overloaded;
+}
+
+static void
+runq_account(uint64_t now, uint64_t delay) {
+    hist_add(&histograms[HIST_RUNQ], delay);
+    overload_sample(now, delay);
+}
+
+static void
+hold_account_out(coro_rec_t *self, uint64_t now) {
+    uint64_t held;
+
+    if (watchdog_ns)
+        watchdog_arm(0);
+    if (hold_rec == self) {
+        held = now - hold_mark;
+        self->cputime += held;
+        hist_add(&histograms[HIST_HOLD], held);
+        if (watchdog_ns && held > watchdog_ns)
+            hog_report(self, held);
+    }
+    hold_rec = NULL;
+    hold_ts = NULL;
+}
+
+static void
+hold_account_in(coro_rec_t *self, uint64_t now) {
+    hold_rec = self;
+    hold_ts = PyThreadState_GET();
+    hold_mark = now;
+    hog_caught = 0;
+    if (watchdog_ns)
+        watchdog_arm(watchdog_ns);
+    if (self->sched_mark) {
+        runq_account(now, now - self->sched_mark);
+        self->sched_mark = 0;
+    }
+}
+
+/* target is being put on the runqueue. Only coroutines that will come 
+   back through switch_in() are marked: no one else would clear the mark. */
+static void
+runq_mark(coev_t *target) {
+    coro_rec_t *rec = coro_rec(target);
+
+    if (rec && (rec->resumable || rec == coro_rec_current()))
+        rec->sched_mark = now_ns();
+}
+
+/* the current coroutine is about to wait for events on fd (-1 for sleep) */
+static void
+wait_note(int fd, int events) {
+    coro_rec_t *self = coro_rec_current();
+
+    if (self) {
+        self->wait_fd = fd;
+        self->wait_events = events;
+    }
+}
+
+static void
+wait_account(uint64_t start, int timedout) {
+    hist_add(&histograms[timedout ? HIST_WAIT_TIMEOUT : HIST_WAIT_EVENT], now_ns() - start);
+}
+
+/** binary event tracing.
+
+    Unlike setdebug(), nothing is formatted while tracing: fixed-size
+    events go into a ring buffer that keeps the latest trace_start()
+    nevents. trace_dump() writes it out; coev.trace converts the dump
+    to Chrome/Perfetto JSON.
+
+    Dump layout, native byte order:
+        header: char magic[8] = "COEVTRC1", uint32 event size,
+                uint32 number of names, uint64 events, uint64 dropped
+        events: trace_event_t, oldest first
+        names:  uint64 coev, uint32 length, treepos bytes;
+                one per coroutine live at dump time
+**/
+
+typedef struct {
+    uint64_t ts;        /* CLOCK_MONOTONIC ns */
+    uint64_t coev;      /* current coroutine */
+    uint64_t arg;       /* target coroutine, fd, or byte count */
+    uint32_t type;
+    uint32_t arg2;      /* events, status, or errno */
+} trace_event_t;
+
+enum {
+    TRACE_SWITCH_OUT = 1, /* arg: direct switch target or 0 */
+    TRACE_SWITCH_IN,      /* arg2: coev_t::status */
+    TRACE_SCHEDULE,       /* arg: target */
+    TRACE_WAIT_START,     /* arg: fd or -1 for sleep, arg2: events */
+    TRACE_WAIT_END,       /* arg2: coev_t::status */
+    TRACE_READ_START,     /* arg: fd */
+    TRACE_READ_END,       /* arg: bytes or -1, arg2: errno */
+    TRACE_WRITE_START,    /* arg: fd */
+    TRACE_WRITE_END       /* arg: bytes or -1, arg2: errno */
+};
+
+#define TRACE_MAX_EVENTS (1 << 26)
+
+static trace_event_t *trace_buf;
+static uint64_t trace_mask;
+static uint64_t trace_head;
+
+#define TRACE(type, arg, arg2) do { if (trace_buf) \
+    trace_add((type), (uint64_t)(arg), (uint32_t)(arg2)); } while (0)
+
+static void
+trace_add(uint32_t type, uint64_t arg, uint32_t arg2) {
+    trace_event_t *e = &trace_buf[trace_head++ & trace_mask];
+
+    e->ts = now_ns();
+    e->coev = (uint64_t)(size_t)coev_current();
+    e->arg = arg;
+    e->type = type;
+    e->arg2 = arg2;
+}
+
+/** GIL-keeping switch.
+
+    Under the ucoev threading model all coroutines share one OS thread,
+    and the GIL need not be released at a switch: it only has to change
+    hands along with the thread state. When the switch target is known
+    to be parked in switch_out() itself, the GIL is left locked, only
+    the thread state is swapped out, and gil_parked tells the switch_in()
+    on the other side that the GIL is already held. A switch that fails
+    comes back to the same switch_in(), so only one reached from another
+    coroutine counts as a fast switch.
+
+    Everything else goes through the regular PyEval_SaveThread() and
+    PyEval_RestoreThread(): the scheduler may resume coroutines parked
+    elsewhere (lock waits, not yet started ones, coev_loop() caller),
+    and those reacquire the GIL in the usual way.
+
+    switch_out(NULL) is for switches into the scheduler. setfastswitch()
+    turns the fast path off, to measure what it gains.
+**/
+
+static int ucoev_threads;   /* thread ids are coev_t pointers: no real OS threads */
+static int fastswitch;      /* ucoev_threads, unless turned off */
+static coev_t *gil_parked;  /* who left the GIL locked */
+static uint64_t c_fastswitches;
+
+static PyThreadState *
+switch_out(coev_t *target) {
+    coro_rec_t *self, *trec;
+
+    if ((self = coro_rec_current())) {
+        size_t sp = (size_t)&self;
+
+        self->resumable = 1;
+        self->since = now_ns();
+        hold_account_out(self, self->since);
+        /* stacks grow down */
+        if (sp > self->stack_top)
+            self->stack_top = sp;
+        if (!self->stack_low || sp < self->stack_low)
+            self->stack_low = sp;
+    }
+    TRACE(TRACE_SWITCH_OUT, (size_t)target, 0);
+
+    if (fastswitch && target && (trec = coro_rec_find(target)) && trec->resumable) {
+        gil_parked = coev_current();
+        return PyThreadState_Swap(NULL);
+    }
+    return PyEval_SaveThread();
+}
+
+static void
+switch_in(PyThreadState *save) {
+    coro_rec_t *self;
+    int err = errno;
+
+    if (gil_parked) {
+        if (gil_parked != coev_current())
+            c_fastswitches++;
+        gil_parked = NULL;
+        PyThreadState_Swap(save);
+    } else
+        PyEval_RestoreThread(save);
+
+    if ((self = coro_rec_current())) {
+        self->resumable = 0;
+        self->wait_fd = self->wait_events = 0;
+        self->since = now_ns();
+        hold_account_in(self, self->since);
+    }
+    TRACE(TRACE_SWITCH_IN, 0, coev_current()->status);
+    errno = err;
+}
+
 static PyObject *mod_switch_bottom_half(void);
 
 PyDoc_STRVAR(mod_switch_doc,
@@ -154,6 +797,7 @@ exception is raised.");
 
 static PyObject* 
 mod_switch(PyObject *a, PyObject* args) {
+    PyThreadState *tstate;
     PyObject *arg = NULL;
     long target_id;
     coev_t *target;
@@ -178,9 +822,9 @@ mod_switch(PyObject *a, PyObject* args) {
         coev_treepos(coev_current()),
         coev_treepos(target), arg);
 
-    Py_BEGIN_ALLOW_THREADS
+    tstate = switch_out(target);
     coev_switch(target);
-    Py_END_ALLOW_THREADS
+    switch_in(tstate);
     
     return mod_switch_bottom_half();
 }
@@ -280,6 +924,7 @@ PyDoc_STRVAR(mod_throw_doc,
 /** This switches to a coroutine with A=NULL, X=type Y=value S=traceback. */
 static PyObject* 
 mod_throw(PyObject *a, PyObject* args) {
+    PyThreadState *tstate;
     long target_id;
     coev_t *target;
     PyObject *typ = PyExc_SystemExit;
@@ -328,9 +973,9 @@ mod_throw(PyObject *a, PyObject* args) {
     target->Y = val;
     target->S = tb;
     
-    Py_BEGIN_ALLOW_THREADS
+    tstate = switch_out(target);
     coev_switch(target);
-    Py_END_ALLOW_THREADS
+    switch_in(tstate);
     
     return mod_switch_bottom_half();
 
@@ -349,13 +994,16 @@ Stall execution of current coroutine until next runqueue pass.\n\
 
 static PyObject* 
 mod_stall(PyObject *a, PyObject* args) {
+    PyThreadState *tstate;
     int rv;
     coro_dprintf("coev.stall(): current [%s]\n", 
         coev_treepos(coev_current()));
 
-    Py_BEGIN_ALLOW_THREADS
+    runq_mark(coev_current());
+    TRACE(TRACE_SCHEDULE, (size_t)coev_current(), 0);
+    tstate = switch_out(NULL);
     rv = coev_stall();
-    Py_END_ALLOW_THREADS
+    switch_in(tstate);
     
     if ((rv != 0 ) || (coev_current()->status == CSW_SCHEDULER_NEEDED)) {
         PyErr_SetNone(PyExc_CoroNoScheduler);
@@ -372,13 +1020,14 @@ Switch to scheduler.\n\
 
 static PyObject* 
 mod_switch2scheduler(PyObject *a, PyObject* args) {
+    PyThreadState *tstate;
     int rv;
     coro_dprintf("coev.switch2scheduler(): current [%s]\n", 
         coev_treepos(coev_current()));
 
-    Py_BEGIN_ALLOW_THREADS
+    tstate = switch_out(NULL);
     rv = coev_switch2scheduler();
-    Py_END_ALLOW_THREADS
+    switch_in(tstate);
     
     if ((rv != 0 ) || (coev_current()->status == CSW_SCHEDULER_NEEDED)) {
         PyErr_SetNone(PyExc_CoroNoScheduler);
@@ -411,6 +1060,8 @@ typedef struct {
     int busy;
     coev_t *owner;
     int eof;
+    char *scratch;      /* where read_http_head() and read_chunk() collect data */
+    size_t scratch_size;
 } CoroSocketFile;
 
 PyDoc_STRVAR(socketfile_doc,
@@ -449,12 +1100,15 @@ socketfile_new(PyTypeObject *type, PyObject *args, PyObject *kw) {
     
     cnrbuf_init(&self->dabuf, fd, iop_timeout, 4096, rlim);
     self->busy = 0;
+    self->scratch = NULL;
+    self->scratch_size = 0;
     return (PyObject *)self;
 }
 
 static void
 socketfile_dealloc(CoroSocketFile *self) {
     cnrbuf_fini(&self->dabuf);
+    free(self->scratch);
     Py_TYPE(self)->tp_free((PyObject*)self);
 }
 
@@ -463,6 +1117,70 @@ static PyObject *sf_empty_string = NULL;
 
 #define RETURN_EMPTYSTRING_IF(cond) do { if((cond)) { Py_INCREF(sf_empty_string); return sf_empty_string; } } while (0)
 
+/* raises CoroError if another coroutine is in the middle of I/O on self */
+static int
+sf_busy(CoroSocketFile *self) {
+    if (!self->busy)
+        return 0;
+    PyErr_Format(PyExc_CoroError, "socketfile is busy; owner=[%s] accessor=[%s]",
+        self->owner ? self->owner->treepos : "(nil?)",
+        coev_current()->treepos);
+    return -1;
+}
+
+/* does cnrbuf_read() or cnrbuf_readline() with the GIL released.
+   returns what they do, errno is kept for the caller on -1. */
+static Py_ssize_t
+sf_read_some(CoroSocketFile *self, Py_ssize_t sizehint, int line, void **p) {
+    PyThreadState *tstate;
+    uint64_t start;
+    Py_ssize_t rv;
+    int err;
+    
+    self->busy = 1;
+    self->owner = coev_current();
+    start = now_ns();
+    TRACE(TRACE_READ_START, self->dabuf.fd, 0);
+    wait_note(self->dabuf.fd, COEV_READ);
+    tstate = switch_out(NULL);
+    if (line)
+        rv = cnrbuf_readline(&self->dabuf, p, sizehint);
+    else
+        rv = cnrbuf_read(&self->dabuf, p, sizehint);
+    err = errno;
+    switch_in(tstate);
+    wait_account(start, rv == -1 && err == ETIMEDOUT);
+    TRACE(TRACE_READ_END, rv, rv == -1 ? err : 0);
+    self->busy = 0;
+    errno = err;
+    return rv;
+}
+
+/* (status, data) for the try_ variants. steals data. */
+static PyObject *
+io_status(int status, PyObject *data) {
+    if (data == NULL)
+        return NULL;
+    return Py_BuildValue("(iN)", status, data);
+}
+
+static PyObject *
+io_status_empty(int status) {
+    Py_INCREF(sf_empty_string);
+    return io_status(status, sf_empty_string);
+}
+
+static PyObject *
+sf_read_status(CoroSocketFile *self, Py_ssize_t rv, void *p) {
+    if (rv == -1)
+        return io_status_empty(errno);
+    if (rv == 0) {
+        self->eof = 1;
+        return io_status_empty(IO_EOF);
+    }
+    return io_status(IO_OK, PyString_FromStringAndSize(p, rv));
+}
+
 PyDoc_STRVAR(socketfile_read_doc,
 "read([size]) -> bytestr\n\n\
 Read at most size bytes or return whatever there is in buffers (all of in-process and up to 8K from the kernel).\n\
@@ -473,10 +1191,8 @@ socketfile_read(CoroSocketFile *self, PyObject* args) {
     Py_ssize_t rv, sizehint = 0;
     void *p;
     
-    if (self->busy)
-        return PyErr_Format(PyExc_CoroError, "socketfile is busy; owner=[%s] accessor=[%s]",
-            self->owner ? self->owner->treepos : "(nil?)",
-            coev_current()->treepos ), NULL;
+    if (sf_busy(self))
+        return NULL;
     
     if (!PyArg_ParseTuple(args, "|n", &sizehint ))
 	return NULL;
@@ -484,12 +1200,7 @@ socketfile_read(CoroSocketFile *self, PyObject* args) {
     
     RETURN_EMPTYSTRING_IF(self->eof);
     
-    self->busy = 1;
-    self->owner = coev_current();
-    Py_BEGIN_ALLOW_THREADS
-    rv = cnrbuf_read(&self->dabuf, &p, sizehint);
-    Py_END_ALLOW_THREADS    
-    self->busy = 0;
+    rv = sf_read_some(self, sizehint, 0, &p);
     
     if (rv == -1)
         return PyErr_SetFromErrno(PyExc_CoroSocketError);
@@ -511,22 +1222,15 @@ socketfile_readline(CoroSocketFile *self, PyObject* args) {
     Py_ssize_t rv, sizehint = 0;
     void *p;
     
-    if (self->busy)
-        return PyErr_Format(PyExc_CoroError, "socketfile is busy; owner=[%s] accessor=[%s]",
-            self->owner ? self->owner->treepos : "(nil?)",
-            coev_current()->treepos), NULL;
+    if (sf_busy(self))
+        return NULL;
     
     if (!PyArg_ParseTuple(args, "|n", &sizehint ))
 	return NULL;
 
     RETURN_EMPTYSTRING_IF(self->eof);
     
-    self->busy = 1;
-    self->owner = coev_current();
-    Py_BEGIN_ALLOW_THREADS
-    rv = cnrbuf_readline(&self->dabuf, &p, sizehint);
-    Py_END_ALLOW_THREADS
-    self->busy = 0;
+    rv = sf_read_some(self, sizehint, 1, &p);
     
     if (rv == -1) {
         coro_dprintf("socketfile_readline(): setting exception errno=%s\n", strerror(errno));
@@ -542,6 +1246,64 @@ socketfile_readline(CoroSocketFile *self, PyObject* args) {
     return PyString_FromStringAndSize(p, rv);
 }
 
+PyDoc_STRVAR(socketfile_try_read_doc,
+"try_read([size]) -> (status, str)\n\n\
+read() that does not raise on I/O errors. status is IO_OK, IO_EOF\n\
+(with an empty string) or an errno value: ETIMEDOUT on timeout.\n\
+");
+static PyObject * 
+socketfile_try_read(CoroSocketFile *self, PyObject* args) {
+    Py_ssize_t rv, sizehint = 0;
+    void *p = NULL;
+    
+    if (sf_busy(self) || !PyArg_ParseTuple(args, "|n", &sizehint))
+	return NULL;
+    if (self->eof)
+        return io_status_empty(IO_EOF);
+    rv = sf_read_some(self, sizehint, 0, &p);
+    return sf_read_status(self, rv, p);
+}
+
+PyDoc_STRVAR(socketfile_try_readline_doc,
+"try_readline([sizehint]) -> (status, str)\n\n\
+readline() that does not raise on I/O errors, see try_read().\n\
+");
+static PyObject * 
+socketfile_try_readline(CoroSocketFile *self, PyObject* args) {
+    Py_ssize_t rv, sizehint = 0;
+    void *p = NULL;
+    
+    if (sf_busy(self) || !PyArg_ParseTuple(args, "|n", &sizehint))
+	return NULL;
+    if (self->eof)
+        return io_status_empty(IO_EOF);
+    rv = sf_read_some(self, sizehint, 1, &p);
+    return sf_read_status(self, rv, p);
+}
+
+static Py_ssize_t
+sf_write_some(CoroSocketFile *self, const char *str, Py_ssize_t len, Py_ssize_t *written) {
+    PyThreadState *tstate;
+    uint64_t start;
+    Py_ssize_t rv;
+    int err;
+    
+    self->busy = 1;
+    self->owner = coev_current();
+    start = now_ns();
+    TRACE(TRACE_WRITE_START, self->dabuf.fd, 0);
+    wait_note(self->dabuf.fd, COEV_WRITE);
+    tstate = switch_out(NULL);
+    rv = coev_send(self->dabuf.fd, str, len, written, self->dabuf.iop_timeout);
+    err = errno;
+    switch_in(tstate);
+    wait_account(start, rv == -1 && err == ETIMEDOUT);
+    TRACE(TRACE_WRITE_END, rv, rv == -1 ? err : 0);
+    self->busy = 0;
+    errno = err;
+    return rv;
+}
+
 PyDoc_STRVAR(socketfile_write_doc,
 "write(str) -> None\n\n\
 Write the string to the fd. EPIPE results in an exception.\n\
@@ -551,20 +1313,13 @@ socketfile_write(CoroSocketFile *self, PyObject* args) {
     const char *str;
     Py_ssize_t rv, len, written;
 
-    if (self->busy)
-        return PyErr_Format(PyExc_CoroError, "socketfile is busy; owner=[%s] accessor=[%s]",
-            self->owner ? self->owner->treepos : "(nil?)",
-            coev_current()->treepos), NULL;
+    if (sf_busy(self))
+        return NULL;
     
     if (!PyArg_ParseTuple(args, "s#", &str, &len))
 	return NULL;
 
-    self->busy = 1;
-    self->owner = coev_current();
-    Py_BEGIN_ALLOW_THREADS
-    rv = coev_send(self->dabuf.fd, str, len, &written, self->dabuf.iop_timeout);
-    Py_END_ALLOW_THREADS
-    self->busy = 0;
+    rv = sf_write_some(self, str, len, &written);
     
     if (rv == -1)
         return PyErr_SetFromErrno(PyExc_CoroSocketError);
@@ -572,37 +1327,1442 @@ socketfile_write(CoroSocketFile *self, PyObject* args) {
     return PyInt_FromSsize_t(rv);
 }
 
-PyDoc_STRVAR(socketfile_flush_doc,
-"flush() -> None\n\n\
-Noop.\n\
+PyDoc_STRVAR(socketfile_try_write_doc,
+"try_write(str) -> (status, int)\n\n\
+write() that does not raise on I/O errors. status is IO_OK or an errno\n\
+value (ETIMEDOUT, EPIPE, ...); the int is the number of bytes written.\n\
 ");
-
+static PyObject * 
+socketfile_try_write(CoroSocketFile *self, PyObject* args) {
+    const char *str;
+    Py_ssize_t rv, len, written = 0;
+
+    if (sf_busy(self) || !PyArg_ParseTuple(args, "s#", &str, &len))
+	return NULL;
+    rv = sf_write_some(self, str, len, &written);
+    if (rv == -1)
+        return io_status(errno, PyInt_FromSsize_t(written > 0 ? written : 0));
+    return io_status(IO_OK, PyInt_FromSsize_t(rv));
+}
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+/* writes out all of iov, waiting for the fd to become writable as needed.
+   runs with the GIL released. returns bytes written or -1 with errno set. */
+static Py_ssize_t
+sf_writev(int fd, struct iovec *iov, int iovcnt, double timeout) {
+    Py_ssize_t rv, total = 0;
+    
+    while (iovcnt > 0) {
+        rv = writev(fd, iov, iovcnt > IOV_MAX ? IOV_MAX : iovcnt);
+        if (rv == -1) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                return -1;
+            coev_wait(fd, COEV_WRITE, timeout);
+            if (coev_current()->status != CSW_EVENT) {
+                errno = coev_current()->status == CSW_TIMEOUT ? ETIMEDOUT : EINTR;
+                return -1;
+            }
+            continue;
+        }
+        total += rv;
+        for (; iovcnt > 0 && (size_t)rv >= iov->iov_len; iov++, iovcnt--)
+            rv -= iov->iov_len;
+        if (iovcnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + rv;
+            iov->iov_len -= rv;
+        }
+    }
+    return total;
+}
+
+PyDoc_STRVAR(socketfile_writev_doc,
+"writev(sequence) -> int\n\n\
+Write a sequence of strings to the fd with as few writev() calls as possible.\n\
+Returns the number of bytes written. EPIPE results in an exception.\n\
+");
+static PyObject * 
+socketfile_writev(CoroSocketFile *self, PyObject* seq) {
+    PyThreadState *tstate;
+    uint64_t start;
+    PyObject *fast;
+    struct iovec *iov;
+    Py_ssize_t i, n, rv;
+
+    if (sf_busy(self))
+        return NULL;
+    
+    /* a tuple of our own: a list could lose its items while we are switched out */
+    if (!(fast = PySequence_Tuple(seq)))
+        return NULL;
+    n = PyTuple_GET_SIZE(fast);
+    if (!(iov = PyMem_New(struct iovec, n ? n : 1))) {
+        Py_DECREF(fast);
+        return PyErr_NoMemory();
+    }
+    for (i = 0; i < n; i++) {
+        PyObject *item = PyTuple_GET_ITEM(fast, i);
+        
+        if (!PyString_Check(item)) {
+            PyErr_Format(PyExc_TypeError, "writev() item %zd is not a string", i);
+            PyMem_Free(iov);
+            Py_DECREF(fast);
+            return NULL;
+        }
+        iov[i].iov_base = PyString_AS_STRING(item);
+        iov[i].iov_len = PyString_GET_SIZE(item);
+    }
+    
+    self->busy = 1;
+    self->owner = coev_current();
+    start = now_ns();
+    TRACE(TRACE_WRITE_START, self->dabuf.fd, 0);
+    wait_note(self->dabuf.fd, COEV_WRITE);
+    tstate = switch_out(NULL);
+    rv = sf_writev(self->dabuf.fd, iov, n, self->dabuf.iop_timeout);
+    switch_in(tstate);
+    wait_account(start, rv == -1 && errno == ETIMEDOUT);
+    TRACE(TRACE_WRITE_END, rv, rv == -1 ? errno : 0);
+    self->busy = 0;
+    
+    PyMem_Free(iov);
+    Py_DECREF(fast);
+    if (rv == -1)
+        return PyErr_SetFromErrno(PyExc_CoroSocketError);
+    
+    return PyInt_FromSsize_t(rv);
+}
+
+/** HTTP/1.1 message heads and chunked framing.
+
+    The head is collected line by line with cnrbuf_readline() into the
+    socketfile's scratch buffer with the GIL released, then parsed in one
+    pass into as few objects as it takes. The parser is strict (RFC 9112),
+    refusing anything two implementations could frame differently:
+    Content-Length together with Transfer-Encoding, malformed or conflicting
+    Content-Length, transfer codings other than a lone "chunked", obs-fold,
+    whitespace before the colon, control characters, bare CR and bare LF:
+    every line, chunk size lines and the end of chunk data included, has
+    to end with CRLF.
+**/
+
+#define HTTP_HEAD_LIMIT 65536
+#define HTTP_CHUNK_LINE_MAX 4096
+
+typedef struct {
+    Py_ssize_t content_length;  /* -1 if absent */
+    int chunked;
+    int n_te;
+    int n_host;
+} http_framing_t;
+
+static int
+http_tchar(unsigned char c) {
+    if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9'))
+        return 1;
+    return c && strchr("!#$%&'*+-.^_`|~", c) != NULL;
+}
+
+/* HTAB, SP, VCHAR and obs-text: field values, reason phrases, chunk extensions */
+static int
+http_vchar(unsigned char c) {
+    return c == '\t' || (c >= ' ' && c != 0x7f);
+}
+
+static int
+http_version(const char *p) {
+    return memcmp(p, "HTTP/1.", 7) == 0 && isdigit((unsigned char)p[7]);
+}
+
+/* a line as cnrbuf_readline() returns it, ends with CRLF */
+static int
+http_crlf(const char *p, Py_ssize_t len) {
+    return len >= 2 && p[len - 2] == '\r' && p[len - 1] == '\n';
+}
+
+static int
+http_empty_line(const char *p, Py_ssize_t len) {
+    return len == 2 && http_crlf(p, len);
+}
+
+/* the following three run with the GIL released. On failure they return -1
+   with either *why set to a protocol error or errno to a system one. */
+
+static int
+sf_scratch_reserve(CoroSocketFile *self, size_t size) {
+    char *p;
+    size_t n;
+    
+    if (size <= self->scratch_size)
+        return 0;
+    for (n = self->scratch_size ? self->scratch_size : 1024; n < size; n *= 2)
+        ;
+    if ((p = realloc(self->scratch, n)) == NULL)
+        return -1;
+    self->scratch = p;
+    self->scratch_size = n;
+    return 0;
+}
+
+/* collects lines into scratch up to and including an empty one.
+   returns the byte count, 0 on EOF before anything was collected. */
+static Py_ssize_t
+sf_collect_head(CoroSocketFile *self, Py_ssize_t limit, int skip_empty, const char **why) {
+    Py_ssize_t rv, used = 0, seen = 0;
+    char *p;
+    
+    while (1) {
+        if (seen >= limit)
+            return *why = "message head is too large", -1;
+        rv = cnrbuf_readline(&self->dabuf, (void **)&p, limit - seen);
+        if (rv == -1)
+            return -1;
+        if (rv == 0) {
+            if (used == 0)
+                return 0;
+            return *why = "EOF in message head", -1;
+        }
+        seen += rv;
+        if (p[rv - 1] != '\n')
+            return *why = seen >= limit ? "message head is too large" : "EOF in message head", -1;
+        if (!http_crlf(p, rv))
+            return *why = "line not terminated with CRLF", -1;
+        /* empty lines before a request line are to be ignored */
+        if (used == 0 && skip_empty && http_empty_line(p, rv))
+            continue;
+        if (sf_scratch_reserve(self, used + rv) == -1)
+            return -1;
+        memcpy(self->scratch + used, p, rv);
+        used += rv;
+        if (http_empty_line(p, rv))
+            return used;
+    }
+}
+
+/* reads one chunk into scratch. returns its size; for the last
+   chunk returns 0 and collects the trailer section, setting *trailers. */
+static Py_ssize_t
+sf_collect_chunk(CoroSocketFile *self, Py_ssize_t limit, Py_ssize_t *trailers, const char **why) {
+    Py_ssize_t rv, got, size = 0;
+    int digits = 0;
+    char *p, *q, *end;
+    
+    rv = cnrbuf_readline(&self->dabuf, (void **)&p, HTTP_CHUNK_LINE_MAX);
+    if (rv == -1)
+        return -1;
+    if (rv == 0 || p[rv - 1] != '\n')
+        return *why = rv == HTTP_CHUNK_LINE_MAX ? "chunk size line is too long" : "EOF in chunked body", -1;
+    if (!http_crlf(p, rv))
+        return *why = "chunk size line not terminated with CRLF", -1;
+    end = p + rv - 2;
+    for (; p < end && isxdigit((unsigned char)*p); p++) {
+        if (++digits > 15)
+            return *why = "chunk is too large", -1;
+        size = size * 16 + (*p <= '9' ? *p - '0' : (*p | 0x20) - 'a' + 10);
+    }
+    for (q = p; p < end && (*p == ' ' || *p == '\t'); p++)
+        ;
+    if (digits == 0 || (p == end ? p != q : *p != ';'))
+        return *why = "malformed chunk size line", -1;
+    for (; p < end; p++)
+        if (!http_vchar(*p))
+            return *why = "invalid character in chunk extension", -1;
+    
+    if (size == 0) {
+        rv = sf_collect_head(self, limit, 0, why);
+        if (rv == 0)
+            return *why = "EOF in chunked body trailers", -1;
+        if (rv == -1)
+            return -1;
+        *trailers = rv;
+        return 0;
+    }
+    
+    if (size > limit)
+        return *why = "chunk is too large", -1;
+    if (sf_scratch_reserve(self, size) == -1)
+        return -1;
+    for (got = 0; got < size; got += rv) {
+        rv = cnrbuf_read(&self->dabuf, (void **)&p, size - got);
+        if (rv == -1)
+            return -1;
+        if (rv == 0)
+            return *why = "EOF in chunk data", -1;
+        memcpy(self->scratch + got, p, rv);
+    }
+    rv = cnrbuf_readline(&self->dabuf, (void **)&p, 2);
+    if (rv == -1)
+        return -1;
+    if (rv == 0 || !http_empty_line(p, rv))
+        return *why = "missing CRLF after chunk data", -1;
+    return size;
+}
+
+/* validates header fields up to the empty line, noting framing-related ones.
+   appends (name, value) tuples to list if it is not NULL. */
+static int
+http_parse_fields(char *p, char *end, PyObject *list, http_framing_t *fr) {
+    char *eol, *le, *name, *colon, *v, *vend;
+    Py_ssize_t n;
+    PyObject *item;
+    
+    for (; p < end; p = eol + 1) {
+        eol = memchr(p, '\n', end - p);
+        le = eol - 1; /* sf_collect_head() saw to the CR */
+        if (le == p)
+            break;
+        if (*p == ' ' || *p == '\t')
+            return PyErr_SetString(PyExc_CoroHTTPError, "obsolete line folding"), -1;
+        for (name = p; p < le && http_tchar(*p); p++)
+            ;
+        if (p == name || p == le || *p != ':') {
+            PyErr_SetString(PyExc_CoroHTTPError, (p < le && (*p == ' ' || *p == '\t')) 
+                ? "whitespace before colon in header field" : "malformed header field");
+            return -1;
+        }
+        colon = p++;
+        while (p < le && (*p == ' ' || *p == '\t'))
+            p++;
+        for (v = p; p < le; p++)
+            if (!http_vchar(*p))
+                return PyErr_SetString(PyExc_CoroHTTPError, "invalid character in header field value"), -1;
+        for (vend = le; vend > v && (vend[-1] == ' ' || vend[-1] == '\t'); vend--)
+            ;
+        
+        if (colon - name == 14 && strncasecmp(name, "content-length", 14) == 0) {
+            if (vend == v || vend - v > 18)
+                return PyErr_SetString(PyExc_CoroHTTPError, "malformed Content-Length"), -1;
+            for (n = 0, p = v; p < vend; p++) {
+                if (!isdigit((unsigned char)*p))
+                    return PyErr_SetString(PyExc_CoroHTTPError, "malformed Content-Length"), -1;
+                n = n * 10 + (*p - '0');
+            }
+            if (fr->content_length != -1 && fr->content_length != n)
+                return PyErr_SetString(PyExc_CoroHTTPError, "conflicting Content-Length"), -1;
+            fr->content_length = n;
+        } else if (colon - name == 17 && strncasecmp(name, "transfer-encoding", 17) == 0) {
+            if (++fr->n_te > 1)
+                return PyErr_SetString(PyExc_CoroHTTPError, "multiple Transfer-Encoding fields"), -1;
+            if (vend - v != 7 || strncasecmp(v, "chunked", 7) != 0)
+                return PyErr_SetString(PyExc_CoroHTTPError, "unsupported transfer coding"), -1;
+            fr->chunked = 1;
+        } else if (colon - name == 4 && strncasecmp(name, "host", 4) == 0) {
+            fr->n_host++;
+        }
+        
+        if (list) {
+            item = Py_BuildValue("(s#s#)", name, (Py_ssize_t)(colon - name), v, (Py_ssize_t)(vend - v));
+            if (item == NULL || PyList_Append(list, item) == -1) {
+                Py_XDECREF(item);
+                return -1;
+            }
+            Py_DECREF(item);
+        }
+    }
+    return 0;
+}
+
+static PyObject *
+http_parse_head(char *buf, Py_ssize_t len) {
+    http_framing_t fr = { -1, 0, 0, 0 };
+    char *eol, *le, *a, *b;
+    PyObject *headers, *length;
+    int status;
+    
+    eol = memchr(buf, '\n', len);
+    le = eol - 1;
+    
+    if (!(headers = PyList_New(0)))
+        return NULL;
+    if (http_parse_fields(eol + 1, buf + len, headers, &fr) == -1)
+        goto fail;
+    if (fr.content_length != -1 && fr.n_te) {
+        PyErr_SetString(PyExc_CoroHTTPError, "both Content-Length and Transfer-Encoding present");
+        goto fail;
+    }
+    
+    if (le - buf >= 5 && memcmp(buf, "HTTP/", 5) == 0) {
+        /* status-line = HTTP-version SP 3DIGIT SP reason-phrase */
+        if (le - buf < 12 || !http_version(buf) || buf[8] != ' ' 
+                || !isdigit((unsigned char)buf[9]) || !isdigit((unsigned char)buf[10]) 
+                || !isdigit((unsigned char)buf[11]) || (le - buf > 12 && buf[12] != ' ')) {
+            PyErr_SetString(PyExc_CoroHTTPError, "malformed status line");
+            goto fail;
+        }
+        for (a = buf + 13; a < le; a++)
+            if (!http_vchar(*a)) {
+                PyErr_SetString(PyExc_CoroHTTPError, "invalid character in reason phrase");
+                goto fail;
+            }
+        status = (buf[9] - '0') * 100 + (buf[10] - '0') * 10 + (buf[11] - '0');
+        /* RFC 9112 6.3: never a body, whatever the framing headers say */
+        if (status < 200 || status == 204 || status == 304)
+            length = PyInt_FromLong(0);
+        else if (fr.chunked)
+            length = PyInt_FromLong(-1);
+        else if (fr.content_length != -1)
+            length = PyInt_FromSsize_t(fr.content_length);
+        else {
+            Py_INCREF(Py_None);
+            length = Py_None;
+        }
+        if (length == NULL)
+            goto fail;
+        a = le - buf > 12 ? buf + 13 : le;
+        return Py_BuildValue("(s#is#NN)", buf, (Py_ssize_t)8, status, 
+            a, (Py_ssize_t)(le - a), headers, length);
+    }
+    
+    /* request-line = method SP request-target SP HTTP-version */
+    for (a = buf; a < le && http_tchar(*a); a++)
+        ;
+    for (b = a + 1; b < le && (unsigned char)*b > ' ' && (unsigned char)*b < 0x7f; b++)
+        ;
+    if (a == buf || a == le || *a != ' ' || b == a + 1 || le - b != 9 || *b != ' ' || !http_version(b + 1)) {
+        PyErr_SetString(PyExc_CoroHTTPError, "malformed request line");
+        goto fail;
+    }
+    if (fr.n_host > 1 || (fr.n_host == 0 && b[8] != '0')) {
+        PyErr_SetString(PyExc_CoroHTTPError, "missing or repeated Host");
+        goto fail;
+    }
+    if (fr.n_te && b[8] == '0') {
+        PyErr_SetString(PyExc_CoroHTTPError, "Transfer-Encoding in an HTTP/1.0 request");
+        goto fail;
+    }
+    if (!(length = PyInt_FromSsize_t(fr.chunked ? -1 : fr.content_length != -1 ? fr.content_length : 0)))
+        goto fail;
+    return Py_BuildValue("(s#s#s#NN)", buf, (Py_ssize_t)(a - buf), a + 1, (Py_ssize_t)(b - a - 1),
+        b + 1, (Py_ssize_t)8, headers, length);
+    
+  fail:
+    Py_DECREF(headers);
+    return NULL;
+}
+
+PyDoc_STRVAR(socketfile_read_http_head_doc,
+"read_http_head([limit]) -> tuple or None\n\n\
+Read and parse an HTTP/1.x message head, returning\n\
+    (method, target, version, headers, length) for a request, or\n\
+    (version, status, reason, headers, length) for a response.\n\
+headers -- list of (name, value) tuples as received, values stripped.\n\
+length -- body length: Content-Length, -1 for chunked (see read_chunk()),\n\
+          0 for requests without a body and 1xx, 204 and 304 responses,\n\
+          None for responses delimited by close. Responses to HEAD\n\
+          have no body either; the caller is to know that.\n\
+limit -- maximum head size, 64K by default.\n\
+Returns None on EOF before the head. Raises HTTPError on malformed or\n\
+ambiguous heads; the connection is to be closed then.\n\
+");
+static PyObject *
+socketfile_read_http_head(CoroSocketFile *self, PyObject* args) {
+    PyThreadState *tstate;
+    uint64_t start;
+    Py_ssize_t rv, limit = HTTP_HEAD_LIMIT;
+    const char *why = NULL;
+    
+    if (sf_busy(self))
+        return NULL;
+    
+    if (!PyArg_ParseTuple(args, "|n", &limit))
+	return NULL;
+    if (limit <= 0) {
+	PyErr_SetString(PyExc_ValueError, "limit must be positive");
+	return NULL;
+    }
+    if (self->eof)
+        Py_RETURN_NONE;
+    
+    self->busy = 1;
+    self->owner = coev_current();
+    start = now_ns();
+    TRACE(TRACE_READ_START, self->dabuf.fd, 0);
+    wait_note(self->dabuf.fd, COEV_READ);
+    tstate = switch_out(NULL);
+    rv = sf_collect_head(self, limit, 1, &why);
+    switch_in(tstate);
+    wait_account(start, rv == -1 && !why && errno == ETIMEDOUT);
+    TRACE(TRACE_READ_END, rv, rv == -1 && !why ? errno : 0);
+    self->busy = 0;
+    
+    if (rv == -1) {
+        if (why)
+            return PyErr_SetString(PyExc_CoroHTTPError, why), NULL;
+        return PyErr_SetFromErrno(PyExc_CoroSocketError);
+    }
+    if (rv == 0) {
+        self->eof = 1;
+        Py_RETURN_NONE;
+    }
+    return http_parse_head(self->scratch, rv);
+}
+
+PyDoc_STRVAR(socketfile_read_chunk_doc,
+"read_chunk([limit]) -> str\n\n\
+Read one chunk of a chunked body. Returns an empty string for the last\n\
+chunk, after reading and validating the trailer section, which is discarded.\n\
+limit -- maximum chunk and trailer section size, 64K by default.\n\
+Raises HTTPError on framing errors.\n\
+");
+static PyObject *
+socketfile_read_chunk(CoroSocketFile *self, PyObject* args) {
+    PyThreadState *tstate;
+    uint64_t start;
+    Py_ssize_t rv, trailers = 0, limit = HTTP_HEAD_LIMIT;
+    const char *why = NULL;
+    http_framing_t fr = { -1, 0, 0, 0 };
+    
+    if (sf_busy(self))
+        return NULL;
+    
+    if (!PyArg_ParseTuple(args, "|n", &limit))
+	return NULL;
+    if (limit <= 0) {
+	PyErr_SetString(PyExc_ValueError, "limit must be positive");
+	return NULL;
+    }
+    if (self->eof)
+        return PyErr_SetString(PyExc_CoroHTTPError, "EOF in chunked body"), NULL;
+    
+    self->busy = 1;
+    self->owner = coev_current();
+    start = now_ns();
+    TRACE(TRACE_READ_START, self->dabuf.fd, 0);
+    wait_note(self->dabuf.fd, COEV_READ);
+    tstate = switch_out(NULL);
+    rv = sf_collect_chunk(self, limit, &trailers, &why);
+    switch_in(tstate);
+    wait_account(start, rv == -1 && !why && errno == ETIMEDOUT);
+    TRACE(TRACE_READ_END, rv, rv == -1 && !why ? errno : 0);
+    self->busy = 0;
+    
+    if (rv == -1) {
+        if (why)
+            return PyErr_SetString(PyExc_CoroHTTPError, why), NULL;
+        return PyErr_SetFromErrno(PyExc_CoroSocketError);
+    }
+    if (rv == 0) {
+        if (http_parse_fields(self->scratch, self->scratch + trailers, NULL, &fr) == -1)
+            return NULL;
+        Py_INCREF(sf_empty_string);
+        return sf_empty_string;
+    }
+    return PyString_FromStringAndSize(self->scratch, rv);
+}
+
+/** cache protocol replies: memcached text and binary, redis RESP.
+
+    As with HTTP heads, replies - for a whole batch of pipelined requests
+    at once, if asked to - are collected into the scratch buffer with the
+    GIL released, and turned into objects in one pass afterwards.
+**/
+
+#define PROTO_REPLY_LIMIT (64 << 20)
+#define PROTO_LINE_MAX 8192
+#define RESP_DEPTH_MAX 64
+
+typedef Py_ssize_t (*sf_collect_fn)(CoroSocketFile *, void *, const char **);
+
+/* runs collect(self, arg, &why) with the GIL released, the way the methods
+   above do their I/O. returns what it returns, errno is kept on -1. */
+static Py_ssize_t
+sf_collect_some(CoroSocketFile *self, sf_collect_fn collect, void *arg, const char **why) {
+    PyThreadState *tstate;
+    uint64_t start;
+    Py_ssize_t rv;
+    int err;
+    
+    self->busy = 1;
+    self->owner = coev_current();
+    start = now_ns();
+    TRACE(TRACE_READ_START, self->dabuf.fd, 0);
+    wait_note(self->dabuf.fd, COEV_READ);
+    tstate = switch_out(NULL);
+    rv = collect(self, arg, why);
+    err = errno;
+    switch_in(tstate);
+    wait_account(start, rv == -1 && !*why && err == ETIMEDOUT);
+    TRACE(TRACE_READ_END, rv, rv == -1 && !*why ? err : 0);
+    self->busy = 0;
+    errno = err;
+    return rv;
+}
+
+/* sf_collect_some() that raises: on -1 an exception is set. */
+static Py_ssize_t
+sf_collect(CoroSocketFile *self, sf_collect_fn collect, void *arg) {
+    Py_ssize_t rv;
+    const char *why = NULL;
+    
+    if (sf_busy(self))
+        return -1;
+    if (self->eof) {
+        PyErr_SetString(PyExc_CoroProtocolError, "unexpected EOF");
+        return -1;
+    }
+    
+    rv = sf_collect_some(self, collect, arg, &why);
+    
+    if (rv == -1) {
+        if (why)
+            PyErr_SetString(PyExc_CoroProtocolError, why);
+        else
+            PyErr_SetFromErrno(PyExc_CoroSocketError);
+    }
+    return rv;
+}
+
+/* the following run with the GIL released, see sf_collect_head(). */
+
+static Py_ssize_t
+sf_read_into(CoroSocketFile *self, char *dst, Py_ssize_t n, const char **why) {
+    Py_ssize_t rv, got;
+    void *p;
+    
+    for (got = 0; got < n; got += rv) {
+        rv = cnrbuf_read(&self->dabuf, &p, n - got);
+        if (rv == -1)
+            return -1;
+        if (rv == 0)
+            return got;
+        memcpy(dst + got, p, rv);
+    }
+    return got;
+}
+
+static int
+sf_append_exactly(CoroSocketFile *self, Py_ssize_t *used, Py_ssize_t n, Py_ssize_t limit, const char **why) {
+    Py_ssize_t rv;
+    
+    if (n > limit - *used)
+        return *why = "reply is too large", -1;
+    if (sf_scratch_reserve(self, *used + n) == -1)
+        return -1;
+    if ((rv = sf_read_into(self, self->scratch + *used, n, why)) == -1)
+        return -1;
+    if (rv < n)
+        return *why = "unexpected EOF", -1;
+    *used += n;
+    return 0;
+}
+
+/* appends a CRLF-terminated line to scratch, returning its offset */
+static Py_ssize_t
+sf_append_line(CoroSocketFile *self, Py_ssize_t *used, Py_ssize_t limit, const char **why) {
+    Py_ssize_t rv, off, max = limit - *used;
+    char *p;
+    
+    if (max > PROTO_LINE_MAX)
+        max = PROTO_LINE_MAX;
+    if (max <= 0)
+        return *why = "reply is too large", -1;
+    rv = cnrbuf_readline(&self->dabuf, (void **)&p, max);
+    if (rv == -1)
+        return -1;
+    if (rv == 0 || (p[rv - 1] != '\n' && rv < max))
+        return *why = "unexpected EOF", -1;
+    if (p[rv - 1] != '\n')
+        return *why = "reply line is too long", -1;
+    if (rv < 2 || p[rv - 2] != '\r')
+        return *why = "reply line does not end in CRLF", -1;
+    if (sf_scratch_reserve(self, *used + rv) == -1)
+        return -1;
+    memcpy(self->scratch + *used, p, rv);
+    off = *used;
+    *used += rv;
+    return off;
+}
+
+/* decimal number, no sign, no leading or trailing junk */
+static int
+proto_ull(const char *p, const char *end, unsigned long long *rv) {
+    unsigned long long n = 0;
+    
+    if (p == end || end - p > 20)
+        return -1;
+    for (; p < end; p++) {
+        if (*p < '0' || *p > '9' || n > (ULLONG_MAX - (*p - '0')) / 10)
+            return -1;
+        n = n * 10 + (*p - '0');
+    }
+    *rv = n;
+    return 0;
+}
+
+static int
+proto_ll(const char *p, const char *end, long long *rv) {
+    unsigned long long n;
+    int neg = (p < end && *p == '-');
+    
+    if (proto_ull(p + neg, end, &n) || n > (unsigned long long)LLONG_MAX + neg)
+        return -1;
+    *rv = neg ? (long long)(0 - n) : (long long)n;
+    return 0;
+}
+
+typedef struct {
+    const char *key;
+    Py_ssize_t keylen;
+    unsigned long long flags, bytes, cas;
+    int has_cas;
+} mc_value_t;
+
+/* VALUE <key> <flags> <bytes> [<cas unique>], CRLF stripped */
+static int
+mc_parse_value(const char *p, const char *end, mc_value_t *v) {
+    const char *tok[4], *tend[4];
+    int n;
+    
+    for (p += 6, n = 0; n < 4 && p < end; n++) {
+        for (tok[n] = p; p < end && *p != ' '; p++)
+            ;
+        tend[n] = p;
+        if (p < end && ++p == end)
+            return -1;
+    }
+    if (p < end || n < 3 || tok[0] == tend[0])
+        return -1;
+    v->key = tok[0];
+    v->keylen = tend[0] - tok[0];
+    if (proto_ull(tok[1], tend[1], &v->flags) || v->flags > 0xffffffffUL)
+        return -1;
+    if (proto_ull(tok[2], tend[2], &v->bytes) || v->bytes > PROTO_REPLY_LIMIT)
+        return -1;
+    v->has_cas = (n == 4);
+    if (v->has_cas && proto_ull(tok[3], tend[3], &v->cas))
+        return -1;
+    return 0;
+}
+
+/* VALUE blocks up to and including END or whatever else the server says instead */
+static Py_ssize_t
+sf_collect_mc_values(CoroSocketFile *self, void *arg, const char **why) {
+    Py_ssize_t off, used = 0, limit = *(Py_ssize_t *)arg;
+    char *line, *end;
+    mc_value_t v;
+    
+    while (1) {
+        if ((off = sf_append_line(self, &used, limit, why)) == -1)
+            return -1;
+        line = self->scratch + off;
+        end = self->scratch + used - 2;
+        if (end - line < 6 || memcmp(line, "VALUE ", 6) != 0)
+            return used;
+        if (mc_parse_value(line, end, &v) == -1)
+            return *why = "malformed VALUE line", -1;
+        if (sf_append_exactly(self, &used, (Py_ssize_t)v.bytes + 2, limit, why) == -1)
+            return -1;
+        if (memcmp(self->scratch + used - 2, "\r\n", 2) != 0)
+            return *why = "VALUE data does not end in CRLF", -1;
+    }
+}
+
+typedef struct {
+    Py_ssize_t count;
+    Py_ssize_t limit;
+} resp_collect_t;
+
+/* count complete RESP2 replies, one if count is -1 */
+static Py_ssize_t
+sf_collect_resp(CoroSocketFile *self, void *arg, const char **why) {
+    resp_collect_t *rc = arg;
+    Py_ssize_t off, used = 0, pending = rc->count == -1 ? 1 : rc->count;
+    long long n;
+    char *line, *end;
+    
+    for (; pending > 0; pending--) {
+        if ((off = sf_append_line(self, &used, rc->limit, why)) == -1)
+            return -1;
+        line = self->scratch + off;
+        end = self->scratch + used - 2;
+        switch (line[0]) {
+            case '+':
+            case '-':
+                break;
+            case ':':
+                if (proto_ll(line + 1, end, &n))
+                    return *why = "malformed integer reply", -1;
+                break;
+            case '$':
+                if (proto_ll(line + 1, end, &n) || n < -1 || n > rc->limit)
+                    return *why = "malformed bulk reply length", -1;
+                if (n == -1)
+                    break;
+                if (sf_append_exactly(self, &used, (Py_ssize_t)n + 2, rc->limit, why) == -1)
+                    return -1;
+                if (memcmp(self->scratch + used - 2, "\r\n", 2) != 0)
+                    return *why = "bulk reply does not end in CRLF", -1;
+                break;
+            case '*':
+                /* each element takes at least 3 bytes */
+                if (proto_ll(line + 1, end, &n) || n < -1 || n > rc->limit / 3)
+                    return *why = "malformed multi-bulk reply length", -1;
+                if (n > 0)
+                    pending += n;
+                break;
+            default:
+                return *why = "unknown reply type", -1;
+        }
+    }
+    return used;
+}
+
+typedef struct {
+    int until;
+    Py_ssize_t limit;
+} mcbin_collect_t;
+
+#define MCBIN_HEADER 24
+
+static unsigned long
+mcbin_u32(const unsigned char *p) {
+    return ((unsigned long)p[0] << 24) | ((unsigned long)p[1] << 16) | ((unsigned long)p[2] << 8) | p[3];
+}
+
+/* binary protocol response packets up to one with the until opcode */
+static Py_ssize_t
+sf_collect_mcbin(CoroSocketFile *self, void *arg, const char **why) {
+    mcbin_collect_t *mc = arg;
+    Py_ssize_t start, used = 0;
+    unsigned char *h;
+    unsigned long bodylen;
+    int opcode;
+    
+    do {
+        start = used;
+        if (sf_append_exactly(self, &used, MCBIN_HEADER, mc->limit, why) == -1)
+            return -1;
+        h = (unsigned char *)self->scratch + start;
+        if (h[0] != 0x81)
+            return *why = "bad magic in binary protocol response", -1;
+        opcode = h[1];
+        bodylen = mcbin_u32(h + 8);
+        if ((unsigned long)h[4] + ((h[2] << 8) | h[3]) > bodylen)
+            return *why = "malformed binary protocol response", -1;
+        if (bodylen > (unsigned long)mc->limit)
+            return *why = "reply is too large", -1;
+        if (sf_append_exactly(self, &used, bodylen, mc->limit, why) == -1)
+            return -1;
+    } while (mc->until >= 0 && opcode != mc->until);
+    return used;
+}
+
+typedef struct {
+    char *dst;
+    Py_ssize_t n;
+} readexactly_t;
+
+static Py_ssize_t
+sf_collect_exactly(CoroSocketFile *self, void *arg, const char **why) {
+    readexactly_t *re = arg;
+    Py_ssize_t rv;
+    
+    if ((rv = sf_read_into(self, re->dst, re->n, why)) == -1)
+        return -1;
+    if (rv > 0 && rv < re->n)
+        return *why = "unexpected EOF", -1;
+    return rv;
+}
+
+PyDoc_STRVAR(socketfile_readexactly_doc,
+"readexactly(size) -> str\n\n\
+Read exactly size bytes. Returns an empty string on EOF before the first\n\
+byte; EOF after it raises ProtocolError.\n\
+");
+static PyObject *
+socketfile_readexactly(CoroSocketFile *self, PyObject* args) {
+    readexactly_t re;
+    PyObject *rv;
+    Py_ssize_t got;
+    
+    if (!PyArg_ParseTuple(args, "n", &re.n))
+	return NULL;
+    if (re.n < 0) {
+	PyErr_SetString(PyExc_ValueError, "size must not be negative");
+	return NULL;
+    }
+    RETURN_EMPTYSTRING_IF(self->eof || re.n == 0);
+    if (!(rv = PyString_FromStringAndSize(NULL, re.n)))
+        return NULL;
+    re.dst = PyString_AS_STRING(rv);
+    if ((got = sf_collect(self, sf_collect_exactly, &re)) == -1) {
+        Py_DECREF(rv);
+        return NULL;
+    }
+    if (got == 0) {
+        Py_DECREF(rv);
+        RETURN_EMPTYSTRING_IF((self->eof = 1));
+    }
+    return rv;
+}
+
+static Py_ssize_t
+sf_collect_upto(CoroSocketFile *self, void *arg, const char **why) {
+    readexactly_t *re = arg;
+    
+    return sf_read_into(self, re->dst, re->n, why);
+}
+
+PyDoc_STRVAR(socketfile_try_readexactly_doc,
+"try_readexactly(size) -> (status, str)\n\n\
+readexactly() that does not raise on I/O errors, see try_read().\n\
+On EOF status is IO_EOF, and the string has whatever came before it.\n\
+");
+static PyObject *
+socketfile_try_readexactly(CoroSocketFile *self, PyObject* args) {
+    readexactly_t re;
+    PyObject *rv;
+    Py_ssize_t got;
+    const char *why = NULL;
+    
+    if (sf_busy(self) || !PyArg_ParseTuple(args, "n", &re.n))
+	return NULL;
+    if (re.n < 0) {
+	PyErr_SetString(PyExc_ValueError, "size must not be negative");
+	return NULL;
+    }
+    if (self->eof)
+        return io_status_empty(IO_EOF);
+    if (re.n == 0)
+        return io_status_empty(IO_OK);
+    if (!(rv = PyString_FromStringAndSize(NULL, re.n)))
+        return NULL;
+    re.dst = PyString_AS_STRING(rv);
+    if ((got = sf_collect_some(self, sf_collect_upto, &re, &why)) == -1) {
+        Py_DECREF(rv);
+        return io_status_empty(errno);
+    }
+    if (got < re.n) {
+        self->eof = 1;
+        if (_PyString_Resize(&rv, got) < 0)
+            return NULL;
+        return io_status(IO_EOF, rv);
+    }
+    return io_status(IO_OK, rv);
+}
+
+PyDoc_STRVAR(socketfile_read_mc_values_doc,
+"read_mc_values([limit]) -> list\n\n\
+Read a memcached text protocol retrieval reply: VALUE blocks up to END.\n\
+Returns a list of (key, flags, data, cas) tuples, cas is None unless\n\
+the server sent it (gets). Other replies raise ProtocolError with the\n\
+server's message.\n\
+limit -- maximum reply size, 64M by default.\n\
+");
+static PyObject *
+socketfile_read_mc_values(CoroSocketFile *self, PyObject* args) {
+    Py_ssize_t used, limit = PROTO_REPLY_LIMIT;
+    PyObject *list, *item;
+    char *p, *eol;
+    mc_value_t v;
+    
+    if (!PyArg_ParseTuple(args, "|n", &limit))
+	return NULL;
+    if ((used = sf_collect(self, sf_collect_mc_values, &limit)) == -1)
+        return NULL;
+    if (!(list = PyList_New(0)))
+        return NULL;
+    for (p = self->scratch; ; p = eol + 2 + v.bytes + 2) {
+        eol = memchr(p, '\n', used - (p - self->scratch)) - 1;
+        if (eol - p < 6 || memcmp(p, "VALUE ", 6) != 0)
+            break;
+        mc_parse_value(p, eol, &v);
+        item = Py_BuildValue("(s#ks#N)", v.key, v.keylen, (unsigned long)v.flags, 
+            eol + 2, (Py_ssize_t)v.bytes, 
+            v.has_cas ? PyLong_FromUnsignedLongLong(v.cas) : (Py_INCREF(Py_None), Py_None));
+        if (item == NULL || PyList_Append(list, item) == -1) {
+            Py_XDECREF(item);
+            Py_DECREF(list);
+            return NULL;
+        }
+        Py_DECREF(item);
+    }
+    if (eol - p != 3 || memcmp(p, "END", 3) != 0) {
+        if ((item = PyString_FromStringAndSize(p, eol - p))) {
+            PyErr_SetObject(PyExc_CoroProtocolError, item);
+            Py_DECREF(item);
+        }
+        Py_DECREF(list);
+        return NULL;
+    }
+    return list;
+}
+
+static PyObject *
+resp_parse(char **pp, char *end, int depth) {
+    char *p = *pp, *eol = (char *)memchr(p, '\n', end - p) - 1;
+    long long n;
+    Py_ssize_t i;
+    PyObject *rv, *item;
+    
+    *pp = eol + 2;
+    switch (*p) {
+        case '+':
+            return PyString_FromStringAndSize(p + 1, eol - p - 1);
+        case '-':
+            return PyObject_CallFunction(PyExc_CoroRESPError, "s#", p + 1, (Py_ssize_t)(eol - p - 1));
+        case ':':
+            proto_ll(p + 1, eol, &n);
+            if (n >= LONG_MIN && n <= LONG_MAX)
+                return PyInt_FromLong((long)n);
+            return PyLong_FromLongLong(n);
+        case '$':
+            proto_ll(p + 1, eol, &n);
+            if (n == -1)
+                Py_RETURN_NONE;
+            *pp += n + 2;
+            return PyString_FromStringAndSize(eol + 2, (Py_ssize_t)n);
+        default: /* '*' */
+            proto_ll(p + 1, eol, &n);
+            if (n == -1)
+                Py_RETURN_NONE;
+            if (depth == RESP_DEPTH_MAX)
+                return PyErr_SetString(PyExc_CoroProtocolError, "multi-bulk replies nested too deep"), NULL;
+            if (!(rv = PyList_New((Py_ssize_t)n)))
+                return NULL;
+            for (i = 0; i < n; i++) {
+                if (!(item = resp_parse(pp, end, depth + 1))) {
+                    Py_DECREF(rv);
+                    return NULL;
+                }
+                PyList_SET_ITEM(rv, i, item);
+            }
+            return rv;
+    }
+}
+
+PyDoc_STRVAR(socketfile_read_resp_doc,
+"read_resp([count[, limit]]) -> object or list\n\n\
+Read a redis (RESP2) reply, or a list of count replies to pipelined\n\
+commands when count is given. Status replies become str, integers\n\
+int or long, bulk replies str or None, multi-bulk replies lists or None,\n\
+error replies RESPError instances, returned, not raised.\n\
+limit -- maximum size of all replies, 64M by default.\n\
+");
+static PyObject *
+socketfile_read_resp(CoroSocketFile *self, PyObject* args) {
+    resp_collect_t rc = { -1, PROTO_REPLY_LIMIT };
+    Py_ssize_t i, used;
+    PyObject *rv, *item;
+    char *p;
+    
+    if (!PyArg_ParseTuple(args, "|nn", &rc.count, &rc.limit))
+	return NULL;
+    if (rc.count < -1) {
+	PyErr_SetString(PyExc_ValueError, "count must not be negative");
+	return NULL;
+    }
+    if ((used = sf_collect(self, sf_collect_resp, &rc)) == -1)
+        return NULL;
+    p = self->scratch;
+    if (rc.count == -1)
+        return resp_parse(&p, p + used, 0);
+    if (!(rv = PyList_New(rc.count)))
+        return NULL;
+    for (i = 0; i < rc.count; i++) {
+        if (!(item = resp_parse(&p, self->scratch + used, 0))) {
+            Py_DECREF(rv);
+            return NULL;
+        }
+        PyList_SET_ITEM(rv, i, item);
+    }
+    return rv;
+}
+
+PyDoc_STRVAR(socketfile_read_mcbin_doc,
+"read_mcbin([until[, limit]]) -> list\n\n\
+Read memcached binary protocol response packets, one or, with until,\n\
+up to and including one with that opcode (say, the NOOP ending a run\n\
+of quiet gets). Returns a list of (opcode, status, opaque, cas,\n\
+extras, key, value) tuples.\n\
+limit -- maximum size of all packets, 64M by default.\n\
+");
+static PyObject *
+socketfile_read_mcbin(CoroSocketFile *self, PyObject* args) {
+    mcbin_collect_t mc = { -1, PROTO_REPLY_LIMIT };
+    Py_ssize_t used, keylen, extlen, bodylen;
+    PyObject *list, *item;
+    unsigned char *h, *end;
+    
+    if (!PyArg_ParseTuple(args, "|in", &mc.until, &mc.limit))
+	return NULL;
+    if ((used = sf_collect(self, sf_collect_mcbin, &mc)) == -1)
+        return NULL;
+    if (!(list = PyList_New(0)))
+        return NULL;
+    for (h = (unsigned char *)self->scratch, end = h + used; h < end; h += MCBIN_HEADER + bodylen) {
+        keylen = (h[2] << 8) | h[3];
+        extlen = h[4];
+        bodylen = mcbin_u32(h + 8);
+        item = Py_BuildValue("(iikNs#s#s#)", h[1], (h[6] << 8) | h[7], mcbin_u32(h + 12),
+            PyLong_FromUnsignedLongLong(((unsigned long long)mcbin_u32(h + 16) << 32) | mcbin_u32(h + 20)),
+            h + MCBIN_HEADER, extlen,
+            h + MCBIN_HEADER + extlen, keylen,
+            h + MCBIN_HEADER + extlen + keylen, bodylen - extlen - keylen);
+        if (item == NULL || PyList_Append(list, item) == -1) {
+            Py_XDECREF(item);
+            Py_DECREF(list);
+            return NULL;
+        }
+        Py_DECREF(item);
+    }
+    return list;
+}
+
+PyDoc_STRVAR(socketfile_flush_doc,
+"flush() -> None\n\n\
+Noop.\n\
+");
+
 PyDoc_STRVAR(socketfile_close_doc,
 "close() -> None\n\n\
 Noop.\n\
 ");
 
 static PyObject *
-socketfile_noop(PyObject *self) {
-    Py_RETURN_NONE;
+socketfile_noop(PyObject *self) {
+    Py_RETURN_NONE;
+}
+
+static PyMethodDef socketfile_methods[] = {
+    {"read",  (PyCFunction) socketfile_read,  METH_VARARGS, socketfile_read_doc},
+    {"readline", (PyCFunction) socketfile_readline, METH_VARARGS, socketfile_readline_doc},
+    {"write", (PyCFunction) socketfile_write, METH_VARARGS, socketfile_write_doc},
+    {"writev", (PyCFunction) socketfile_writev, METH_O, socketfile_writev_doc},
+    {"read_http_head", (PyCFunction) socketfile_read_http_head, METH_VARARGS, socketfile_read_http_head_doc},
+    {"read_chunk", (PyCFunction) socketfile_read_chunk, METH_VARARGS, socketfile_read_chunk_doc},
+    {"readexactly", (PyCFunction) socketfile_readexactly, METH_VARARGS, socketfile_readexactly_doc},
+    {"read_mc_values", (PyCFunction) socketfile_read_mc_values, METH_VARARGS, socketfile_read_mc_values_doc},
+    {"read_mcbin", (PyCFunction) socketfile_read_mcbin, METH_VARARGS, socketfile_read_mcbin_doc},
+    {"read_resp", (PyCFunction) socketfile_read_resp, METH_VARARGS, socketfile_read_resp_doc},
+    {"try_read", (PyCFunction) socketfile_try_read, METH_VARARGS, socketfile_try_read_doc},
+    {"try_readline", (PyCFunction) socketfile_try_readline, METH_VARARGS, socketfile_try_readline_doc},
+    {"try_write", (PyCFunction) socketfile_try_write, METH_VARARGS, socketfile_try_write_doc},
+    {"try_readexactly", (PyCFunction) socketfile_try_readexactly, METH_VARARGS, socketfile_try_readexactly_doc},
+    {"flush", (PyCFunction) socketfile_noop, METH_NOARGS, socketfile_flush_doc},
+    {"close", (PyCFunction) socketfile_noop, METH_NOARGS, socketfile_close_doc},
+    { 0 }
+};
+
+static PyTypeObject CoroSocketFile_Type = {
+    PyObject_HEAD_INIT(NULL)
+    /* ob_size           */ 0,
+    /* tp_name           */ "coev.socketfile",
+    /* tp_basicsize      */ sizeof(CoroSocketFile),
+    /* tp_itemsize       */ 0,
+    /* tp_dealloc        */ (destructor)socketfile_dealloc,
+    /* tp_print          */ 0,
+    /* tp_getattr        */ 0,
+    /* tp_setattr        */ 0,
+    /* tp_compare        */ 0,
+    /* tp_repr           */ 0,
+    /* tp_as_number      */ 0,
+    /* tp_as_sequence    */ 0,
+    /* tp_as_mapping     */ 0,
+    /* tp_hash           */ 0,
+    /* tp_call           */ 0,
+    /* tp_str            */ 0,
+    /* tp_getattro       */ 0,
+    /* tp_setattro       */ 0,
+    /* tp_as_buffer      */ 0,
+    /* tp_flags          */ Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE,
+    /* tp_doc            */ socketfile_doc,
+    /* tp_traverse       */ 0,
+    /* tp_clear          */ 0,
+    /* tp_richcompare    */ 0,
+    /* tp_weaklistoffset */ 0,
+    /* tp_iter           */ 0,
+    /* tp_iternext       */ 0,
+    /* tp_methods        */ socketfile_methods,
+    /* tp_members        */ 0,
+    /* tp_getset         */ 0,
+    /* tp_base           */ 0,
+    /* tp_dict           */ 0,
+    /* tp_descr_get      */ 0,
+    /* tp_descr_set      */ 0,
+    /* tp_dictoffset     */ 0,
+    /* tp_init           */ 0,
+    /* tp_alloc          */ 0,
+    /* tp_new            */ socketfile_new
+};
+
+/** coev.local - coroutine-local storage.
+
+    Each coev.local instance gets a slot number. Each coroutine that uses
+    locals gets a LocalSlots object - an array of per-instance attribute
+    dicts indexed by slot - which is found through its module record, so
+    a lookup costs no more than a record cache check and an index on top
+    of the attribute access itself. LocalSlots objects are owned by the
+    coroutine's thread state dict, so when the coroutine exits and its
+    thread state is cleared, the values go with it.
+
+    For the cycle collector, the dicts of a slot belong to its instance,
+    not to the LocalSlots: those are held by thread states, which would
+    keep every value reachable, and l.me = l would never be collected.
+    LocalSlots are not tracked; the instance visits its slot in all of
+    them, and clearing it drops the values everywhere. All of them are
+    on the local_slots list for that, so the cost is in coroutines that
+    have locals, not in all the coroutines ever seen.
+**/
+
+typedef struct _local_slots {
+    PyObject_HEAD
+    struct _local_slots *prev, *next; /* on the local_slots list */
+    coro_rec_t *rec;
+    Py_ssize_t size;
+    PyObject **dicts;
+} LocalSlots;
+
+typedef struct {
+    PyObject_HEAD
+    Py_ssize_t slot;
+    PyObject *args;
+    PyObject *kw;
+    PyObject *dict;     /* the current coroutine's, swapped in for generic attribute access */
+    PyObject *weakreflist;
+} CoroLocal;
+
+static CoroLocal **local_tab;       /* slot -> instance, borrowed */
+static Py_ssize_t local_tab_size;
+static PyObject *local_slots_key;   /* in thread state dicts */
+static LocalSlots *local_slots;     /* all of them */
+
+static void
+localslots_dealloc(LocalSlots *self) {
+    Py_ssize_t i;
+    
+    if (self->rec->locals == self)
+        self->rec->locals = NULL;
+    if (self->prev)
+        self->prev->next = self->next;
+    else
+        local_slots = self->next;
+    if (self->next)
+        self->next->prev = self->prev;
+    for (i = 0; i < self->size; i++)
+        Py_CLEAR(self->dicts[i]);
+    PyMem_Free(self->dicts);
+    PyObject_Del(self);
+}
+
+static PyTypeObject LocalSlots_Type = {
+    PyObject_HEAD_INIT(NULL)
+    0,                                  /* ob_size */
+    "_coev.localslots",                 /* tp_name */
+    sizeof(LocalSlots),                 /* tp_basicsize */
+    0,                                  /* tp_itemsize */
+    (destructor)localslots_dealloc,     /* tp_dealloc */
+};
+
+/* the current coroutine's slot array, made to have room for slot */
+static LocalSlots *
+local_slots_current(Py_ssize_t slot) {
+    coro_rec_t *rec;
+    LocalSlots *ls;
+    PyObject *tdict, **dicts;
+    
+    if (!(rec = coro_rec_current()))
+        return (LocalSlots *)PyErr_NoMemory();
+    if (!(ls = rec->locals)) {
+        if (!(tdict = PyThreadState_GetDict())) {
+            PyErr_SetString(PyExc_SystemError, "coev.local: no thread state dict");
+            return NULL;
+        }
+        if (!(ls = PyObject_New(LocalSlots, &LocalSlots_Type)))
+            return NULL;
+        ls->rec = rec;
+        ls->size = 0;
+        ls->dicts = NULL;
+        ls->prev = NULL;
+        if ((ls->next = local_slots))
+            local_slots->prev = ls;
+        local_slots = ls;
+        if (PyDict_SetItem(tdict, local_slots_key, (PyObject *)ls) < 0) {
+            Py_DECREF(ls);
+            return NULL;
+        }
+        Py_DECREF(ls);
+        rec->locals = ls;
+    }
+    if (slot >= ls->size) {
+        if (!(dicts = PyMem_Realloc(ls->dicts, local_tab_size * sizeof(PyObject *))))
+            return (LocalSlots *)PyErr_NoMemory();
+        memset(dicts + ls->size, 0, (local_tab_size - ls->size) * sizeof(PyObject *));
+        ls->dicts = dicts;
+        ls->size = local_tab_size;
+    }
+    return ls;
+}
+
+/* the current coroutine's attribute dict, also installed as self->dict.
+   new dicts get __init__ called, as threading.local does. Returns borrowed. */
+static PyObject *
+local_getdict(CoroLocal *self) {
+    LocalSlots *ls;
+    PyObject *ldict, *tmp;
+    
+    if (!(ls = local_slots_current(self->slot)))
+        return NULL;
+    if (!(ldict = ls->dicts[self->slot])) {
+        if (!(ldict = PyDict_New()))
+            return NULL;
+        ls->dicts[self->slot] = ldict;
+        tmp = self->dict;
+        Py_INCREF(ldict);
+        self->dict = ldict;
+        Py_XDECREF(tmp);
+        if (Py_TYPE(self)->tp_init != PyBaseObject_Type.tp_init
+                && Py_TYPE(self)->tp_init((PyObject *)self, self->args, self->kw) < 0) {
+            Py_CLEAR(ls->dicts[self->slot]);
+            return NULL;
+        }
+    }
+    /* __init__ might have switched to someone using this local */
+    if (self->dict != ldict) {
+        tmp = self->dict;
+        Py_INCREF(ldict);
+        self->dict = ldict;
+        Py_XDECREF(tmp);
+    }
+    return ldict;
+}
+
+static PyObject *
+local_new(PyTypeObject *type, PyObject *args, PyObject *kw) {
+    CoroLocal *self;
+    CoroLocal **tab;
+    Py_ssize_t i, n;
+    
+    if (type->tp_init == PyBaseObject_Type.tp_init
+            && ((args && PyObject_IsTrue(args)) || (kw && PyObject_IsTrue(kw)))) {
+        PyErr_SetString(PyExc_TypeError, "Initialization arguments are not supported");
+        return NULL;
+    }
+    for (i = 0; i < local_tab_size && local_tab[i]; i++)
+        ;
+    if (i == local_tab_size) {
+        n = local_tab_size ? local_tab_size * 2 : 16;
+        if (!(tab = PyMem_Realloc(local_tab, n * sizeof(CoroLocal *))))
+            return PyErr_NoMemory();
+        memset(tab + local_tab_size, 0, (n - local_tab_size) * sizeof(CoroLocal *));
+        local_tab = tab;
+        local_tab_size = n;
+    }
+    if (!(self = (CoroLocal *)type->tp_alloc(type, 0)))
+        return NULL;
+    Py_XINCREF(args);
+    self->args = args;
+    Py_XINCREF(kw);
+    self->kw = kw;
+    self->slot = i;
+    local_tab[i] = self;
+    return (PyObject *)self;
+}
+
+static int
+local_traverse(CoroLocal *self, visitproc visit, void *arg) {
+    LocalSlots *ls;
+
+    Py_VISIT(self->args);
+    Py_VISIT(self->kw);
+    Py_VISIT(self->dict);
+    for (ls = local_slots; ls; ls = ls->next)
+        if (self->slot < ls->size)
+            Py_VISIT(ls->dicts[self->slot]);
+    return 0;
+}
+
+/* takes the values out of every coroutine's slots before dropping any:
+   that can run code that would use locals */
+static void
+local_drop_values(CoroLocal *self) {
+    PyObject *dead, *tmp;
+    LocalSlots *ls;
+
+    if (!(dead = PyList_New(0))) {
+        PyErr_Clear();
+        return;
+    }
+    for (ls = local_slots; ls; ls = ls->next) {
+        if (self->slot < ls->size && ls->dicts[self->slot]) {
+            tmp = ls->dicts[self->slot];
+            ls->dicts[self->slot] = NULL;
+            if (PyList_Append(dead, tmp) < 0) {
+                PyErr_Clear();
+                ls->dicts[self->slot] = tmp;
+                continue;
+            }
+            Py_DECREF(tmp);
+        }
+    }
+    tmp = self->dict;
+    self->dict = NULL;
+    Py_XDECREF(tmp);
+    Py_DECREF(dead);
+}
+
+static int
+local_clear(CoroLocal *self) {
+    local_drop_values(self);
+    Py_CLEAR(self->args);
+    Py_CLEAR(self->kw);
+    return 0;
+}
+
+static void
+local_dealloc(CoroLocal *self) {
+    PyObject_GC_UnTrack(self);
+    if (self->weakreflist)
+        PyObject_ClearWeakRefs((PyObject *)self);
+    local_clear(self);
+    local_tab[self->slot] = NULL;
+    Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+static PyObject *
+local_getattro(CoroLocal *self, PyObject *name) {
+    PyObject *ldict;
+    
+    if (!(ldict = local_getdict(self)))
+        return NULL;
+    if (PyString_Check(name) && strcmp(PyString_AS_STRING(name), "__dict__") == 0) {
+        Py_INCREF(ldict);
+        return ldict;
+    }
+    return PyObject_GenericGetAttr((PyObject *)self, name);
 }
 
-static PyMethodDef socketfile_methods[] = {
-    {"read",  (PyCFunction) socketfile_read,  METH_VARARGS, socketfile_read_doc},
-    {"readline", (PyCFunction) socketfile_readline, METH_VARARGS, socketfile_readline_doc},
-    {"write", (PyCFunction) socketfile_write, METH_VARARGS, socketfile_write_doc},
-    {"flush", (PyCFunction) socketfile_noop, METH_NOARGS, socketfile_flush_doc},
-    {"close", (PyCFunction) socketfile_noop, METH_NOARGS, socketfile_close_doc},
-    { 0 }
-};
+static int
+local_setattro(CoroLocal *self, PyObject *name, PyObject *v) {
+    if (!local_getdict(self))
+        return -1;
+    if (PyString_Check(name) && strcmp(PyString_AS_STRING(name), "__dict__") == 0) {
+        PyErr_Format(PyExc_AttributeError, "'%.50s' object attribute '__dict__' is read-only",
+            Py_TYPE(self)->tp_name);
+        return -1;
+    }
+    return PyObject_GenericSetAttr((PyObject *)self, name, v);
+}
 
-static PyTypeObject CoroSocketFile_Type = {
+PyDoc_STRVAR(local_doc,
+"local() -> coroutine-local data object\n\n\
+Like threading.local, per coroutine. Subclasses may define __init__,\n\
+which is called in each coroutine on first access, with the arguments\n\
+the instance was created with. Values are freed when the coroutine\n\
+exits. See also local_snapshot(), local_restore() and spawn(copy_locals).\n\
+");
+
+static PyTypeObject CoroLocal_Type = {
     PyObject_HEAD_INIT(NULL)
     /* ob_size           */ 0,
-    /* tp_name           */ "coev.socketfile",
-    /* tp_basicsize      */ sizeof(CoroSocketFile),
+    /* tp_name           */ "coev.local",
+    /* tp_basicsize      */ sizeof(CoroLocal),
     /* tp_itemsize       */ 0,
-    /* tp_dealloc        */ (destructor)socketfile_dealloc,
+    /* tp_dealloc        */ (destructor)local_dealloc,
     /* tp_print          */ 0,
     /* tp_getattr        */ 0,
     /* tp_setattr        */ 0,
@@ -614,30 +2774,94 @@ static PyTypeObject CoroSocketFile_Type = {
     /* tp_hash           */ 0,
     /* tp_call           */ 0,
     /* tp_str            */ 0,
-    /* tp_getattro       */ 0,
-    /* tp_setattro       */ 0,
+    /* tp_getattro       */ (getattrofunc)local_getattro,
+    /* tp_setattro       */ (setattrofunc)local_setattro,
     /* tp_as_buffer      */ 0,
-    /* tp_flags          */ Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE,
-    /* tp_doc            */ socketfile_doc,
-    /* tp_traverse       */ 0,
-    /* tp_clear          */ 0,
+    /* tp_flags          */ Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE | Py_TPFLAGS_HAVE_GC,
+    /* tp_doc            */ local_doc,
+    /* tp_traverse       */ (traverseproc)local_traverse,
+    /* tp_clear          */ (inquiry)local_clear,
     /* tp_richcompare    */ 0,
-    /* tp_weaklistoffset */ 0,
+    /* tp_weaklistoffset */ offsetof(CoroLocal, weakreflist),
     /* tp_iter           */ 0,
     /* tp_iternext       */ 0,
-    /* tp_methods        */ socketfile_methods,
+    /* tp_methods        */ 0,
     /* tp_members        */ 0,
     /* tp_getset         */ 0,
     /* tp_base           */ 0,
     /* tp_dict           */ 0,
     /* tp_descr_get      */ 0,
     /* tp_descr_set      */ 0,
-    /* tp_dictoffset     */ 0,
+    /* tp_dictoffset     */ offsetof(CoroLocal, dict),
     /* tp_init           */ 0,
     /* tp_alloc          */ 0,
-    /* tp_new            */ socketfile_new
+    /* tp_new            */ local_new
 };
 
+PyDoc_STRVAR(mod_local_snapshot_doc,
+"local_snapshot() -> list\n\n\
+Shallow copies of all coev.local values of the current coroutine,\n\
+as a list of (local, dict), to be installed with local_restore().");
+
+static PyObject *
+mod_local_snapshot(PyObject *a, PyObject *noargs) {
+    coro_rec_t *rec;
+    PyObject *rv, *item;
+    Py_ssize_t i;
+    
+    if (!(rv = PyList_New(0)))
+        return NULL;
+    if (!(rec = coro_rec_current()) || !rec->locals)
+        return rv;
+    for (i = 0; i < rec->locals->size; i++) {
+        if (!rec->locals->dicts[i] || !local_tab[i] || !PyDict_Size(rec->locals->dicts[i]))
+            continue;
+        item = Py_BuildValue("(ON)", local_tab[i], PyDict_Copy(rec->locals->dicts[i]));
+        if (!item || PyList_Append(rv, item) < 0) {
+            Py_XDECREF(item);
+            Py_DECREF(rv);
+            return NULL;
+        }
+        Py_DECREF(item);
+    }
+    return rv;
+}
+
+PyDoc_STRVAR(mod_local_restore_doc,
+"local_restore(snapshot) -> None\n\n\
+Install copies of the values from a local_snapshot() in the current\n\
+coroutine, replacing whatever the locals held. __init__ is not called\n\
+for them.");
+
+static PyObject *
+mod_local_restore(PyObject *a, PyObject *args) {
+    PyObject *snapshot, *item, *copy, *tmp;
+    CoroLocal *local;
+    LocalSlots *ls;
+    Py_ssize_t i;
+    
+    if (!PyArg_ParseTuple(args, "O!", &PyList_Type, &snapshot))
+        return NULL;
+    for (i = 0; i < PyList_GET_SIZE(snapshot); i++) {
+        item = PyList_GET_ITEM(snapshot, i);
+        if (!PyTuple_Check(item) || PyTuple_GET_SIZE(item) != 2 
+                || !PyObject_TypeCheck(PyTuple_GET_ITEM(item, 0), &CoroLocal_Type)
+                || !PyDict_Check(PyTuple_GET_ITEM(item, 1))) {
+            PyErr_SetString(PyExc_TypeError, "local_restore() takes what local_snapshot() returns");
+            return NULL;
+        }
+        local = (CoroLocal *)PyTuple_GET_ITEM(item, 0);
+        if (!(ls = local_slots_current(local->slot)))
+            return NULL;
+        if (!(copy = PyDict_Copy(PyTuple_GET_ITEM(item, 1))))
+            return NULL;
+        tmp = ls->dicts[local->slot];
+        ls->dicts[local->slot] = copy;
+        Py_XDECREF(tmp);
+    }
+    Py_RETURN_NONE;
+}
+
 /** Module definition */
 /* FIXME: wait/sleep can possibly leak reference to passed-in value */
 /* FIXME: remember WTH I was thinking when I wrote the above */
@@ -649,6 +2873,32 @@ fd -- file descriptor (integer).\n\
 revents -- bitmask.\n\
 timeout -- in seconds.");
 
+/* a timer that fired at start + timeout: whatever passed since is queueing delay */
+static void
+timer_account(uint64_t start, double timeout) {
+    uint64_t now = now_ns(), due = start + (uint64_t)(timeout * 1e9);
+
+    if (timeout >= 0 && now > due)
+        runq_account(now, now - due);
+}
+
+static void
+wait_io(int fd, int revents, double timeout) {
+    PyThreadState *tstate;
+    uint64_t start;
+    
+    start = now_ns();
+    TRACE(TRACE_WAIT_START, fd, revents);
+    wait_note(fd, revents);
+    tstate = switch_out(NULL);
+    coev_wait(fd, revents, timeout);
+    switch_in(tstate);
+    wait_account(start, coev_current()->status == CSW_TIMEOUT);
+    if (coev_current()->status == CSW_TIMEOUT)
+        timer_account(start, timeout);
+    TRACE(TRACE_WAIT_END, 0, coev_current()->status);
+}
+
 static PyObject *
 mod_wait(PyObject *a, PyObject* args) {
     int fd, revents;
@@ -657,13 +2907,45 @@ mod_wait(PyObject *a, PyObject* args) {
     if (!PyArg_ParseTuple(args, "iid", &fd, &revents, &timeout))
 	return NULL;
     
-    Py_BEGIN_ALLOW_THREADS
-    coev_wait(fd, revents, timeout);
-    Py_END_ALLOW_THREADS
+    wait_io(fd, revents, timeout);
     
     return mod_wait_bottom_half();
 }
 
+/* try_wait() and try_sleep() status; what does not map to one is raised */
+static PyObject *
+mod_wait_status(void) {
+    switch (coev_current()->status) {
+        case CSW_EVENT:
+	case CSW_WAKEUP:
+            return PyInt_FromLong(IO_OK);
+        case CSW_TIMEOUT:
+            return PyInt_FromLong(ETIMEDOUT);
+        case CSW_VOLUNTARY:
+            return PyInt_FromLong(EINTR);
+        default:
+            return mod_wait_bottom_half();
+    }
+}
+
+PyDoc_STRVAR(mod_try_wait_doc,
+"try_wait(fd, events, timeout) -> status\n\n\
+wait() that returns a status instead of raising Timeout and WaitAbort:\n\
+IO_OK, ETIMEDOUT, or EINTR for a voluntary switch into the coroutine.");
+
+static PyObject *
+mod_try_wait(PyObject *a, PyObject* args) {
+    int fd, revents;
+    double timeout;
+    
+    if (!PyArg_ParseTuple(args, "iid", &fd, &revents, &timeout))
+	return NULL;
+    
+    wait_io(fd, revents, timeout);
+    
+    return mod_wait_status();
+}
+
 static PyObject *
 mod_wait_bottom_half(void) {
     coev_t *cur;
@@ -727,6 +3009,22 @@ PyDoc_STRVAR(mod_sleep_doc,
 Switch to scheduler until at least amount seconds pass.\n\
 amount -- number of seconds to sleep.");
 
+static void
+sleep_for(double timeout) {
+    PyThreadState *tstate;
+    uint64_t start;
+    
+    start = now_ns();
+    TRACE(TRACE_WAIT_START, -1, 0);
+    wait_note(-1, 0);
+    tstate = switch_out(NULL);
+    coev_sleep(timeout);
+    switch_in(tstate);
+    if (coev_current()->status == CSW_WAKEUP)
+        timer_account(start, timeout);
+    TRACE(TRACE_WAIT_END, 0, coev_current()->status);
+}
+
 static PyObject *
 mod_sleep(PyObject *a, PyObject *args) {
     double timeout;
@@ -734,14 +3032,27 @@ mod_sleep(PyObject *a, PyObject *args) {
     if (!PyArg_ParseTuple(args, "d", &timeout))
 	return NULL;
 
-    Py_BEGIN_ALLOW_THREADS
-    coev_sleep(timeout);
-    Py_END_ALLOW_THREADS
-        
+    sleep_for(timeout);
     
     return mod_wait_bottom_half();
 }
 
+PyDoc_STRVAR(mod_try_sleep_doc,
+"try_sleep(amount) -> status\n\n\
+sleep() that returns a status instead of raising, see try_wait().");
+
+static PyObject *
+mod_try_sleep(PyObject *a, PyObject *args) {
+    double timeout;
+    
+    if (!PyArg_ParseTuple(args, "d", &timeout))
+	return NULL;
+
+    sleep_for(timeout);
+    
+    return mod_wait_status();
+}
+
 PyDoc_STRVAR(mod_schedule_doc,
 "schedule([coroutine], [args]) -> switch rv\n\n\
 Schedule given coroutine (or self) for execution on \n\
@@ -754,6 +3065,7 @@ args -- a tuple to pass to it \n\
 
 static PyObject *
 mod_schedule(PyObject *a, PyObject *args) {
+    PyThreadState *tstate;
     coev_t *target, *current;
     PyObject *argstuple;
     int rv;
@@ -772,10 +3084,12 @@ mod_schedule(PyObject *a, PyObject *args) {
     Py_CLEAR(target->A);
     target->A = argstuple;        
     
+    runq_mark(target);
+    TRACE(TRACE_SCHEDULE, (size_t)target, 0);
     if (target == current) {
-        Py_BEGIN_ALLOW_THREADS
+        tstate = switch_out(NULL);
         rv = coev_schedule(target);
-        Py_END_ALLOW_THREADS
+        switch_in(tstate);
         if (!rv)
             return mod_wait_bottom_half();
     } else {
@@ -798,50 +3112,540 @@ mod_schedule(PyObject *a, PyObject *args) {
             PyErr_SetString(PyExc_CoroError, "unknown coev_schedule return value.");
             break;
     }
-    return NULL;
+    return NULL;
+}
+
+PyDoc_STRVAR(mod_scheduler_doc,
+"scheduler() -> None\n\n\
+Run scheduler: dispatch pending IO or timer events");
+
+static PyObject *
+mod_scheduler(PyObject *a, PyObject *b) {
+    coev_t *sched;
+    coro_dprintf("coev.scheduler(): calling coev_loop() (cur=[%s]).\n", 
+        coev_current()->treepos);
+    Py_BEGIN_ALLOW_THREADS
+    sched = coev_loop();
+    Py_END_ALLOW_THREADS    
+    
+    /* this returns if: 
+         - an ev_unloop() has been called by coev_unloop() or in interrupt handler. 
+         - there's nothing left to schedule
+         - there already is a scheduler.
+    */
+    if (sched != NULL) {
+        coro_dprintf("coev.scheduler(): [%s] is already scheduling. (cur=[%s]).\n", 
+            sched->treepos, coev_current()->treepos);
+        PyErr_Format(PyExc_CoroError, "coev.scheduler(): [%s] is already scheduling. (cur=[%s])",
+            sched->treepos, coev_current()->treepos);
+        return NULL;
+    }
+        
+    coro_dprintf("coev.scheduler(): coev_loop() returned %p (cur=[%s]).\n", 
+        sched, coev_current()->treepos);
+    /* return NULL iff this module set up an exception. */
+    if (PyErr_Occurred() != NULL)
+        return NULL;
+    Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(mod_current_doc,
+"current() -> coroutine\n\n\
+Return ID of currently executing coroutine object");
+
+static PyObject* 
+mod_current(PyObject *a, PyObject *b) {
+    return PyInt_FromLong( ((long)coev_current()) );
+}
+
+PyDoc_STRVAR(mod_cputime_doc,
+"cputime([id]) -> float\n\n\
+Returns seconds the given or current coroutine has spent running\n\
+between switches, as seen by this module.");
+
+static PyObject *
+mod_cputime(PyObject *a, PyObject *args) {
+    long target_id = 0;
+    coev_t *target = coev_current();
+    coro_rec_t *rec;
+    uint64_t t;
+
+    if (!PyArg_ParseTuple(args, "|l:cputime", &target_id))
+        return NULL;
+    if (target_id)
+        target = (coev_t *) target_id;
+
+    if (!(rec = coro_rec_find(target)))
+        return PyFloat_FromDouble(0.0);
+    t = rec->cputime;
+    if (rec == hold_rec)
+        t += now_ns() - hold_mark;
+    return PyFloat_FromDouble(t / 1e9);
+}
+
+PyDoc_STRVAR(mod_top_doc,
+"top([n]) -> [(cputime, id, treepos), ...]\n\n\
+Returns up to n (default 10) live coroutines that have spent\n\
+the most time running, biggest first.");
+
+static PyObject *
+mod_top(PyObject *a, PyObject *args) {
+    Py_ssize_t n = 10;
+    PyObject *rv, *entry;
+    size_t i;
+
+    if (!PyArg_ParseTuple(args, "|n:top", &n))
+        return NULL;
+    if (!(rv = PyList_New(0)))
+        return NULL;
+
+    for (i = 0; i < crtab_size; i++) {
+        if (!crtab[i] || !coro_rec_live(crtab[i]))
+            continue;
+        entry = Py_BuildValue("(dls)", crtab[i]->cputime / 1e9,
+                (long)crtab[i]->coev, coev_treepos(crtab[i]->coev));
+        if (!entry || PyList_Append(rv, entry)) {
+            Py_XDECREF(entry);
+            Py_DECREF(rv);
+            return NULL;
+        }
+        Py_DECREF(entry);
+    }
+    if (PyList_Sort(rv) || PyList_Reverse(rv)
+            || PyList_SetSlice(rv, n < PyList_GET_SIZE(rv) ? n : PyList_GET_SIZE(rv),
+                                PyList_GET_SIZE(rv), NULL)) {
+        Py_DECREF(rv);
+        return NULL;
+    }
+    return rv;
+}
+
+/** stack high-water mark.
+
+    Stack pointers seen at switch points say nothing of how deep a
+    coroutine went in between, so the mark is taken from the memory
+    itself: pages of a stack are not resident until touched and stay
+    so, and the lowest resident page of the contiguous run below the
+    shallowest switch point is as deep as the stack ever went. The
+    frames above that point are not counted. A recycled stack carries
+    its previous owner's pages, and swapped out ones cut the run short,
+    so the mark is an estimate, but not one that misses recursion.
+**/
+
+#define STACK_SCAN_MAX (8 << 20) /* when the size is not known */
+
+static size_t
+stack_hwm(coro_rec_t *rec) {
+    static size_t page;
+    unsigned char vec[256];
+    size_t top, sp, low, limit, n, i;
+
+    if (!page)
+        page = sysconf(_SC_PAGESIZE);
+    top = rec->stack_top;
+    if (rec == coro_rec_current() && (size_t)&top > top)
+        top = (size_t)&top;
+    if (!top)
+        return 0;
+    limit = rec->stack_size ? rec->stack_size : STACK_SCAN_MAX;
+    sp = (top & ~(page - 1)) + page;
+    low = sp - page;
+    /* pages below the one holding top, in chunks of sizeof(vec) pages */
+    while (sp - low < limit && low >= page) {
+        n = (limit - (sp - low)) / page;
+        if (n > sizeof(vec))
+            n = sizeof(vec);
+        if (n > low / page)
+            n = low / page;
+        if (!n)
+            break;
+        if (mincore((void *)(low - n * page), n * page, vec)) {
+            if (n == 1)
+                break;
+            n = 1; /* hit unmapped memory: go page by page */
+            if (mincore((void *)(low - page), page, vec))
+                break;
+        }
+        for (i = n; i > 0 && (vec[i - 1] & 1); i--)
+            low -= page;
+        if (i)
+            break;
+    }
+    if (rec->stack_low && rec->stack_low < low)
+        low = rec->stack_low;
+    return top - low;
+}
+
+PyDoc_STRVAR(mod_stackinfo_doc,
+"stackinfo([id]) -> (size, hwm)\n\n\
+Returns stack size of the given or current coroutine (0 if unknown,\n\
+see setstacksize()) and its high-water mark: how far below the\n\
+shallowest switch point its stack has been touched, as told by\n\
+mincore(). This does include calls made in between switches; it does\n\
+not include the frames above that point, and a stack recycled from an\n\
+exited coroutine starts with that one's mark.");
+
+static PyObject *
+mod_stackinfo(PyObject *a, PyObject *args) {
+    long target_id = 0;
+    coev_t *target = coev_current();
+    coro_rec_t *rec;
+
+    if (!PyArg_ParseTuple(args, "|l:stackinfo", &target_id))
+        return NULL;
+    if (target_id)
+        target = (coev_t *) target_id;
+    if (!(rec = coro_rec_find(target)))
+        return Py_BuildValue("(nn)", (Py_ssize_t)0, (Py_ssize_t)0);
+    return Py_BuildValue("(nn)", (Py_ssize_t)rec->stack_size, (Py_ssize_t)stack_hwm(rec));
+}
+
+PyDoc_STRVAR(mod_setstacksize_doc,
+"setstacksize(id, size) -> None\n\n\
+Records the size the coroutine's stack was allocated with,\n\
+for stackinfo() and stats(). coev.spawn() does this.");
+
+static PyObject *
+mod_setstacksize(PyObject *a, PyObject *args) {
+    long target_id;
+    Py_ssize_t size;
+    coro_rec_t *rec;
+
+    if (!PyArg_ParseTuple(args, "ln:setstacksize", &target_id, &size))
+        return NULL;
+    if (!(rec = coro_rec((coev_t *) target_id)))
+        return PyErr_NoMemory();
+    rec->stack_size = size;
+    Py_RETURN_NONE;
+}
+
+/* self is (created_ns, func, args, kwargs) */
+static PyObject *
+starter_run(PyObject *self, PyObject *unused) {
+    coro_rec_t *rec;
+    uint64_t now = now_ns();
+    PyObject *rv;
+
+    if ((rec = coro_rec_current())) {
+        rec->since = now;
+        /* it was put on the runqueue when created */
+        rec->sched_mark = PyLong_AsUnsignedLongLong(PyTuple_GET_ITEM(self, 0));
+        hold_account_in(rec, now);
+    }
+    rv = PyObject_Call(PyTuple_GET_ITEM(self, 1), PyTuple_GET_ITEM(self, 2),
+            PyTuple_GET_ITEM(self, 3));
+    if ((rec = coro_rec_current()))
+        hold_account_out(rec, now_ns());
+    return rv;
+}
+
+static PyMethodDef starter_def = { "starter", starter_run, METH_NOARGS, NULL };
+
+PyDoc_STRVAR(mod_starter_doc,
+"starter(func, args, kwargs) -> callable\n\n\
+Returns a callable taking no arguments that calls func(*args, **kwargs),\n\
+to be run as a new coroutine: its first and last run slices, which do\n\
+not pass through switch points, are then accounted for in cputime()\n\
+and by the watchdog. coev.spawn() does this.");
+
+static PyObject *
+mod_starter(PyObject *a, PyObject *args) {
+    PyObject *func, *fargs, *kwargs = NULL, *self, *rv;
+
+    if (!PyArg_ParseTuple(args, "OO!|O:starter", &func, &PyTuple_Type, &fargs, &kwargs))
+        return NULL;
+    if (kwargs && !PyDict_Check(kwargs)) {
+        PyErr_SetString(PyExc_TypeError, "kwargs must be a dict");
+        return NULL;
+    }
+    if (!(self = Py_BuildValue("(KOON)", (unsigned long long)now_ns(), func, fargs,
+            kwargs ? (Py_INCREF(kwargs), kwargs) : PyDict_New())))
+        return NULL;
+    rv = PyCFunction_New(&starter_def, self);
+    Py_DECREF(self);
+    return rv;
+}
+
+/* steals val; -1 on error */
+static int
+_set_item_N(PyObject *dick, const char *key, PyObject *val) {
+    int rv;
+
+    if (!val)
+        return -1;
+    rv = PyDict_SetItemString(dick, key, val);
+    Py_DECREF(val);
+    return rv;
+}
+
+static PyObject *
+snapshot_entry(PyThreadState *ts, uint64_t now, int stacks, int hwm) {
+    coev_t *c = (coev_t *)ts->thread_id;
+    coro_rec_t *rec = coro_rec_find(c);
+    PyFrameObject *f = ts->frame;
+    PyObject *e;
+
+    if (!(e = PyDict_New()))
+        return NULL;
+    if (_set_item_N(e, "id", PyInt_FromLong(ts->thread_id))
+        || _set_item_N(e, "treepos", PyString_FromString(coev_treepos(c)))
+        || _set_item_N(e, "state", PyString_FromString(coev_state(c)))
+        || _set_item_N(e, "status", PyString_FromString(coev_status(c)))
+        || _set_item_N(e, "depth", PyInt_FromLong(ts->recursion_depth)))
+        goto error;
+
+    if (f) {
+        if (_set_item_N(e, "frame", Py_BuildValue("(OiO)", f->f_code->co_filename,
+                PyCode_Addr2Line(f->f_code, f->f_lasti), f->f_code->co_name)))
+            goto error;
+    } else if (PyDict_SetItemString(e, "frame", Py_None))
+        goto error;
+    if (stacks && _set_item_N(e, "stack", py_stack(f)))
+        goto error;
+
+    if (!rec)
+        return e;
+
+    if (_set_item_N(e, "cputime", PyFloat_FromDouble(rec->cputime / 1e9)))
+        goto error;
+    if (hwm && _set_item_N(e, "stack_hwm", PyInt_FromSize_t(stack_hwm(rec))))
+        goto error;
+    if (rec->since && _set_item_N(e, "since", PyFloat_FromDouble((now - rec->since) / 1e9)))
+        goto error;
+    if (rec->wait_events) {
+        if (_set_item_N(e, "wait", Py_BuildValue("(ii)", rec->wait_fd, rec->wait_events)))
+            goto error;
+    } else if (rec->wait_fd == -1) {
+        if (_set_item_N(e, "wait", PyString_FromString("sleep")))
+            goto error;
+    }
+    if (rec->sched_mark && _set_item_N(e, "runq_delay",
+                PyFloat_FromDouble((now - rec->sched_mark) / 1e9)))
+        goto error;
+    return e;
+
+  error:
+    Py_DECREF(e);
+    return NULL;
+}
+
+PyDoc_STRVAR(mod_snapshot_doc,
+"snapshot([stacks=False[, hwm=False]]) -> [{...}, ...]\n\n\
+Returns a record for each coroutine running Python code, with keys:\n\
+  id, treepos, state, status -- as the library sees it\n\
+  depth -- Python recursion depth\n\
+  frame -- (filename, lineno, funcname) it is at, or None\n\
+  stack -- list of those, outermost first, if stacks is true\n\
+and, for coroutines that went through this module's switch points:\n\
+  cputime -- see cputime()\n\
+  stack_hwm -- see stackinfo(); only if hwm is true, it takes\n\
+               mincore() calls per coroutine\n\
+  since -- seconds since it last switched in or out\n\
+  wait -- (fd, events) it waits on, or 'sleep'; absent if neither\n\
+  runq_delay -- seconds it has been on the runqueue, if put there\n\
+                by schedule() or stall()\n\
+Lock waits and runqueue positions are kept inside libucoev and are not\n\
+in the records: a coroutine blocked on a lock only shows it in state,\n\
+as the library names it, and has no wait key.\n\
+Nothing is formatted or written anywhere; cost is a dict per coroutine.");
+
+static PyObject *
+mod_snapshot(PyObject *a, PyObject *args, PyObject *kwargs) {
+    static char *kwds[] = { "stacks", "hwm", 0 };
+    int stacks = 0, hwm = 0;
+    PyThreadState *ts;
+    PyObject *rv, *e;
+    uint64_t now = now_ns();
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|ii:snapshot", kwds, &stacks, &hwm))
+        return NULL;
+    if (!ucoev_threads) {
+        PyErr_SetString(PyExc_CoroError, "snapshot() requires the ucoev threading model");
+        return NULL;
+    }
+    if (!(rv = PyList_New(0)))
+        return NULL;
+
+    for (ts = PyInterpreterState_ThreadHead(PyThreadState_GET()->interp); 
+            ts; ts = PyThreadState_Next(ts)) {
+        if (!(e = snapshot_entry(ts, now, stacks, hwm)) || PyList_Append(rv, e)) {
+            Py_XDECREF(e);
+            Py_DECREF(rv);
+            return NULL;
+        }
+        Py_DECREF(e);
+    }
+    return rv;
 }
 
-PyDoc_STRVAR(mod_scheduler_doc,
-"scheduler() -> None\n\n\
-Run scheduler: dispatch pending IO or timer events");
+PyDoc_STRVAR(mod_setfastswitch_doc,
+"setfastswitch(on) -> bool\n\n\
+Turn switching with the GIL kept on or off; returns the previous\n\
+setting. It is on by default and can't be turned on without the\n\
+ucoev threading model. For benchmarks, see coev.bench -slowswitch.");
 
 static PyObject *
-mod_scheduler(PyObject *a, PyObject *b) {
-    coev_t *sched;
-    coro_dprintf("coev.scheduler(): calling coev_loop() (cur=[%s]).\n", 
-        coev_current()->treepos);
-    Py_BEGIN_ALLOW_THREADS
-    sched = coev_loop();
-    Py_END_ALLOW_THREADS    
-    
-    /* this returns if: 
-         - an ev_unloop() has been called by coev_unloop() or in interrupt handler. 
-         - there's nothing left to schedule
-         - there already is a scheduler.
-    */
-    if (sched != NULL) {
-        coro_dprintf("coev.scheduler(): [%s] is already scheduling. (cur=[%s]).\n", 
-            sched->treepos, coev_current()->treepos);
-        PyErr_Format(PyExc_CoroError, "coev.scheduler(): [%s] is already scheduling. (cur=[%s])",
-            sched->treepos, coev_current()->treepos);
+mod_setfastswitch(PyObject *a, PyObject *args) {
+    int on, was = fastswitch;
+
+    if (!PyArg_ParseTuple(args, "i:setfastswitch", &on))
         return NULL;
+    fastswitch = on && ucoev_threads;
+    return PyBool_FromLong(was);
+}
+
+PyDoc_STRVAR(mod_setwatchdog_doc,
+"setwatchdog(threshold_ms) -> None\n\n\
+Record coroutines that run longer than threshold_ms between switches,\n\
+see hogs(). 0 disables. The first call that enables it takes over\n\
+SIGRTMIN, which must not have a handler.");
+
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
+/* a timer that signals the thread coroutines run on */
+static int
+watchdog_init(void) {
+    struct sigaction sa, old;
+    struct sigevent sev;
+    int signo = SIGRTMIN;
+
+    if (sigaction(signo, NULL, &old))
+        return -1;
+    if (old.sa_handler != SIG_DFL) {
+        errno = EBUSY;
+        return -1;
     }
-        
-    coro_dprintf("coev.scheduler(): coev_loop() returned %p (cur=[%s]).\n", 
-        sched, coev_current()->treepos);
-    /* return NULL iff this module set up an exception. */
-    if (PyErr_Occurred() != NULL)
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = watchdog_signal;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    memset(&sev, 0, sizeof(sev));
+    sev.sigev_notify = SIGEV_THREAD_ID;
+    sev.sigev_signo = signo;
+    sev.sigev_notify_thread_id = syscall(SYS_gettid);
+    if (timer_create(CLOCK_MONOTONIC, &sev, &watchdog_timer))
+        return -1;
+    if (sigaction(signo, &sa, NULL)) {
+        timer_delete(watchdog_timer);
+        return -1;
+    }
+    watchdog_signo = signo;
+    return 0;
+}
+
+static PyObject *
+mod_setwatchdog(PyObject *a, PyObject *args) {
+    double ms;
+
+    if (!PyArg_ParseTuple(args, "d:setwatchdog", &ms))
+        return NULL;
+    if (ms < 0) {
+        PyErr_SetString(PyExc_ValueError, "threshold must not be negative");
         return NULL;
+    }
+    if (ms && !watchdog_signo && watchdog_init())
+        return PyErr_SetFromErrno(PyExc_OSError);
+    if (watchdog_ns)
+        watchdog_arm(0);
+    watchdog_ns = (uint64_t)(ms * 1e6);
+    /* the caller's hold counts from now on */
+    if (watchdog_ns && hold_rec)
+        watchdog_arm(watchdog_ns);
     Py_RETURN_NONE;
 }
 
-PyDoc_STRVAR(mod_current_doc,
-"current() -> coroutine\n\n\
-Return ID of currently executing coroutine object");
+PyDoc_STRVAR(mod_hogs_doc,
+"hogs() -> [(id, treepos, seconds, stack), ...]\n\n\
+Returns and forgets coroutines caught by the watchdog, oldest first.\n\
+stack is a list of (filename, lineno, funcname), outermost first,\n\
+taken when the hold reached the threshold, or where it ended if the\n\
+timer did not catch it running Python code. At most 24 innermost\n\
+frames are kept, names are truncated. At most 64 latest records are kept.");
 
-static PyObject* 
-mod_current(PyObject *a, PyObject *b) {
-    return PyInt_FromLong( ((long)coev_current()) );
+static PyObject *
+mod_hogs(PyObject *a, PyObject *b) {
+    PyObject *rv, *stack, *record;
+    hog_t *hog;
+    int i, j;
+
+    if (!(rv = PyList_New(hog_count)))
+        return NULL;
+    for (i = 0; i < hog_count; i++) {
+        hog = &hogs_ring[(hog_next - hog_count + i + HOGS_MAX + 1) % (HOGS_MAX + 1)];
+        if (!(stack = PyList_New(hog->depth))) {
+            Py_DECREF(rv);
+            return NULL;
+        }
+        for (j = 0; j < hog->depth; j++)
+            PyList_SET_ITEM(stack, hog->depth - 1 - j, Py_BuildValue("(sis)",
+                    hog->frames[j].filename, hog->frames[j].lineno, hog->frames[j].name));
+        record = Py_BuildValue("(lsdN)", hog->id, hog->treepos, hog->held, stack);
+        if (!record || PyErr_Occurred()) {
+            Py_XDECREF(record);
+            Py_DECREF(rv);
+            return NULL;
+        }
+        PyList_SET_ITEM(rv, i, record);
+    }
+    hog_count = 0;
+    return rv;
+}
+
+PyDoc_STRVAR(mod_overloaded_doc,
+"overloaded() -> bool\n\n\
+True while coroutines wait on the runqueue longer than the target\n\
+delay, persistently; see setoverload(). Servers should shed or defer\n\
+new work then.");
+
+static PyObject *
+mod_overloaded(PyObject *a, PyObject *b) {
+    int rv = overload_check(now_ns());
+
+    overload_notify();
+    return PyBool_FromLong(rv);
+}
+
+PyDoc_STRVAR(mod_setoverload_doc,
+"setoverload(target_ms[, interval_ms[, hook]]) -> None\n\n\
+Configure the admission controller: overloaded() becomes True once\n\
+runqueue delays stayed above target_ms for interval_ms (5 and 100\n\
+by default). target_ms=0 disables it. hook(overloaded, delay_seconds)\n\
+is called on a change of the state, by the first overloaded() call\n\
+after it, in that coroutine; it may switch. The hook is left as it\n\
+is if not given; None removes it.");
+
+static PyObject *
+mod_setoverload(PyObject *a, PyObject *args) {
+    double target_ms, interval_ms = overload.interval / 1e6;
+    PyObject *hook = NULL, *old;
+
+    if (!PyArg_ParseTuple(args, "d|dO:setoverload", &target_ms, &interval_ms, &hook))
+        return NULL;
+    if (target_ms < 0 || interval_ms <= 0) {
+        PyErr_SetString(PyExc_ValueError, "target must not be negative, interval must be positive");
+        return NULL;
+    }
+    if (hook && hook != Py_None && !PyCallable_Check(hook)) {
+        PyErr_SetString(PyExc_TypeError, "hook must be callable");
+        return NULL;
+    }
+    overload.target = (uint64_t)(target_ms * 1e6);
+    overload.interval = (uint64_t)(interval_ms * 1e6);
+    overload.first_above = 0;
+    overload.overloaded = 0;
+    overload.notified = 0;
+    if (hook) {
+        old = overload.hook;
+        overload.hook = NULL;
+        if (hook != Py_None) {
+            Py_INCREF(hook);
+            overload.hook = hook;
+        }
+        Py_XDECREF(old);
+    }
+    Py_RETURN_NONE;
 }
 
 static int
@@ -869,15 +3673,24 @@ static PyObject *
 mod_stats(PyObject *a, PyObject *b) {
     PyObject *dick;
     coev_instrumentation_t i;
+    uint64_t stack_bytes = 0;
+    size_t r;
     
     coev_getstats(&i);
     
+    for (r = 0; r < crtab_size; r++) {
+        if (!crtab[r] || !coro_rec_live(crtab[r]))
+            continue;
+        stack_bytes += crtab[r]->stack_size;
+    }
+    
     dick = PyDict_New();
     if (!dick)
         return NULL;
 
     if (_add_K_to_dict(dick, "c_ctxswaps", i.c_ctxswaps)) return NULL;
     if (_add_K_to_dict(dick, "c_switches", i.c_switches)) return NULL;
+    if (_add_K_to_dict(dick, "c_fastswitches", c_fastswitches)) return NULL;
     if (_add_K_to_dict(dick, "c_waits", i.c_waits)) return NULL;
     if (_add_K_to_dict(dick, "c_sleeps", i.c_sleeps)) return NULL;
     if (_add_K_to_dict(dick, "c_stalls", i.c_stalls)) return NULL;
@@ -885,6 +3698,7 @@ mod_stats(PyObject *a, PyObject *b) {
     if (_add_K_to_dict(dick, "c_news", i.c_news)) return NULL;
     if (_add_K_to_dict(dick, "stacks.allocated", i.stacks_allocated)) return NULL;
     if (_add_K_to_dict(dick, "stacks.used", i.stacks_used)) return NULL;
+    if (_add_K_to_dict(dick, "stacks.bytes", stack_bytes)) return NULL;
     if (_add_K_to_dict(dick, "cnrbufs.allocated", i.cnrbufs_allocated)) return NULL;
     if (_add_K_to_dict(dick, "cnrbufs.used", i.cnrbufs_used)) return NULL;
     if (_add_K_to_dict(dick, "coevs.allocated", i.coevs_allocated)) return NULL;
@@ -898,10 +3712,630 @@ mod_stats(PyObject *a, PyObject *b) {
     if (_add_K_to_dict(dick, "locks.c_acfails", i.c_lock_acfails)) return NULL;
     if (_add_K_to_dict(dick, "locks.c_waits", i.c_lock_waits)) return NULL;
     if (_add_K_to_dict(dick, "locks.c_releases", i.c_lock_releases)) return NULL;
+    if (_add_K_to_dict(dick, "overload.state", overload_check(now_ns()))) return NULL;
+    if (_add_K_to_dict(dick, "overload.c_overloads", overload.c_overloads)) return NULL;
+
+    return dick;
+}
+
+/* value at quantile q, ns; bucket upper bound, so never underestimated */
+static uint64_t
+hist_quantile(histogram_t *h, double q) {
+    uint64_t seen = 0, want = (uint64_t)(q * h->count + 0.5);
+    uint64_t top;
+    int b;
+
+    if (want < 1)
+        want = 1;
+    for (b = 0; b < HIST_BUCKETS; b++) {
+        seen += h->buckets[b];
+        if (seen >= want)
+            break;
+    }
+    top = hist_bucket_top(b);
+    return top < h->max ? top : h->max;
+}
+
+static PyObject *
+hist_to_dict(histogram_t *h) {
+    PyObject *buckets, *entry;
+    int b;
+
+    if (!(buckets = PyList_New(0)))
+        return NULL;
+    for (b = 0; b < HIST_BUCKETS; b++) {
+        if (!h->buckets[b])
+            continue;
+        entry = Py_BuildValue("(dK)", hist_bucket_top(b) / 1e9, h->buckets[b]);
+        if (!entry || PyList_Append(buckets, entry)) {
+            Py_XDECREF(entry);
+            Py_DECREF(buckets);
+            return NULL;
+        }
+        Py_DECREF(entry);
+    }
+    if (!h->count)
+        return Py_BuildValue("{sKsN}", "count", h->count, "buckets", buckets);
+    return Py_BuildValue("{sKsdsdsdsdsdsdsdsN}",
+        "count", h->count,
+        "sum", h->sum / 1e9,
+        "min", h->min / 1e9,
+        "max", h->max / 1e9,
+        "p50", hist_quantile(h, 0.5) / 1e9,
+        "p90", hist_quantile(h, 0.9) / 1e9,
+        "p99", hist_quantile(h, 0.99) / 1e9,
+        "p999", hist_quantile(h, 0.999) / 1e9,
+        "buckets", buckets);
+}
+
+PyDoc_STRVAR(mod_histograms_doc,
+"histograms([reset=False]) -> {name: {...}}\n\n\
+Returns latency histograms, all values in seconds:\n\
+  hold -- time coroutines ran between switches\n\
+  runq_delay -- from schedule() or stall() until the coroutine ran\n\
+  wait.event -- wait() and socketfile I/O that completed\n\
+  wait.timeout -- same, timed out\n\
+Each has count, sum, min, max, p50, p90, p99, p999, and buckets,\n\
+a list of (upper bound, count) for non-empty buckets.\n\
+reset -- zero the histograms after reading.");
+
+static PyObject *
+mod_histograms(PyObject *a, PyObject *args, PyObject *kwargs) {
+    static char *kwds[] = { "reset", 0 };
+    int reset = 0, i;
+    PyObject *dick, *h;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|i:histograms", kwds, &reset))
+        return NULL;
+    if (!(dick = PyDict_New()))
+        return NULL;
+    for (i = 0; i < HIST_COUNT; i++) {
+        if (!(h = hist_to_dict(&histograms[i]))
+                || PyDict_SetItemString(dick, histograms[i].name, h)) {
+            Py_XDECREF(h);
+            Py_DECREF(dick);
+            return NULL;
+        }
+        Py_DECREF(h);
+    }
+    if (reset)
+        for (i = 0; i < HIST_COUNT; i++) {
+            const char *name = histograms[i].name;
 
+            memset(&histograms[i], 0, sizeof(histogram_t));
+            histograms[i].name = name;
+        }
     return dick;
 }
 
+PyDoc_STRVAR(mod_trace_start_doc,
+"trace_start([nevents]) -> None\n\n\
+Start binary event tracing into a ring buffer of at least nevents\n\
+(default 1M, 32 bytes each, at most 64M). Restarting discards\n\
+recorded events.");
+
+static PyObject *
+mod_trace_start(PyObject *a, PyObject *args) {
+    Py_ssize_t nevents = 1 << 20;
+    uint64_t size = 1024;
+
+    if (!PyArg_ParseTuple(args, "|n:trace_start", &nevents))
+        return NULL;
+    if (nevents <= 0 || nevents > TRACE_MAX_EVENTS) {
+        PyErr_Format(PyExc_ValueError, "nevents must be in 1..%d", TRACE_MAX_EVENTS);
+        return NULL;
+    }
+    while (size < (uint64_t)nevents)
+        size <<= 1;
+    if (size > PY_SSIZE_T_MAX / sizeof(trace_event_t))
+        return PyErr_NoMemory();
+
+    PyMem_Free(trace_buf);
+    trace_buf = PyMem_Malloc(size * sizeof(trace_event_t));
+    if (!trace_buf)
+        return PyErr_NoMemory();
+    trace_mask = size - 1;
+    trace_head = 0;
+    Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(mod_trace_stop_doc,
+"trace_stop() -> None\n\n\
+Stop tracing and discard recorded events.");
+
+static PyObject *
+mod_trace_stop(PyObject *a, PyObject *b) {
+    PyMem_Free(trace_buf);
+    trace_buf = NULL;
+    Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(mod_trace_dump_doc,
+"trace_dump(path) -> int\n\n\
+Write recorded events to path, see coev.trace for the format.\n\
+Tracing goes on. Returns the number of events written.");
+
+static PyObject *
+mod_trace_dump(PyObject *a, PyObject *args) {
+    const char *path;
+    FILE *f;
+    uint64_t count, dropped, i;
+    uint32_t hdr[2], namelen;
+    size_t r;
+
+    if (!PyArg_ParseTuple(args, "s:trace_dump", &path))
+        return NULL;
+    if (!trace_buf) {
+        PyErr_SetString(PyExc_CoroError, "tracing is not started");
+        return NULL;
+    }
+    if (!(f = fopen(path, "wb")))
+        return PyErr_SetFromErrnoWithFilename(PyExc_IOError, (char *)path);
+
+    count = trace_head > trace_mask ? trace_mask + 1 : trace_head;
+    dropped = trace_head - count;
+    hdr[0] = sizeof(trace_event_t);
+    hdr[1] = 0;
+    for (r = 0; r < crtab_size; r++)
+        if (crtab[r] && coro_rec_live(crtab[r]))
+            hdr[1]++;
+
+    fwrite("COEVTRC1", 8, 1, f);
+    fwrite(hdr, sizeof(hdr), 1, f);
+    fwrite(&count, sizeof(count), 1, f);
+    fwrite(&dropped, sizeof(dropped), 1, f);
+    /* the ring wraps at most once */
+    i = dropped & trace_mask;
+    if (i + count > trace_mask + 1) {
+        fwrite(&trace_buf[i], sizeof(trace_event_t), trace_mask + 1 - i, f);
+        fwrite(&trace_buf[0], sizeof(trace_event_t), count - (trace_mask + 1 - i), f);
+    } else
+        fwrite(&trace_buf[i], sizeof(trace_event_t), count, f);
+
+    for (r = 0; r < crtab_size; r++) {
+        uint64_t c;
+        const char *treepos;
+
+        if (!crtab[r] || !coro_rec_live(crtab[r]))
+            continue;
+        c = (uint64_t)(size_t)crtab[r]->coev;
+        treepos = coev_treepos(crtab[r]->coev);
+        namelen = strlen(treepos);
+        fwrite(&c, sizeof(c), 1, f);
+        fwrite(&namelen, sizeof(namelen), 1, f);
+        fwrite(treepos, namelen, 1, f);
+    }
+    if (ferror(f) | fclose(f))
+        return PyErr_SetFromErrnoWithFilename(PyExc_IOError, (char *)path);
+    return PyLong_FromUnsignedLongLong(count);
+}
+
+PyDoc_STRVAR(mod_pidfd_open_doc,
+"pidfd_open(pid) -> fd\n\n\
+Open a close-on-exec pidfd for a child process. It becomes readable,\n\
+say, for wait(fd, READ, timeout), once the child exits.\n\
+Raises OSError with ENOSYS on kernels older than 5.3.");
+
+static PyObject *
+mod_pidfd_open(PyObject *a, PyObject *args) {
+    int pid;
+    long fd;
+    
+    if (!PyArg_ParseTuple(args, "i", &pid))
+	return NULL;
+#ifdef SYS_pidfd_open
+    fd = syscall(SYS_pidfd_open, pid, 0);
+#else
+    fd = -1;
+    errno = ENOSYS;
+#endif
+    if (fd == -1)
+        return PyErr_SetFromErrno(PyExc_OSError);
+    return PyInt_FromLong(fd);
+}
+
+/** coev.relay - moves bytes between two sockets without the GIL or the
+    Python heap: splice() through a pipe per direction where the kernel
+    allows it, read()/write() through a reused buffer where it does not.
+**/
+
+#define RELAY_CHUNK 65536       /* fits the default pipe capacity */
+#define RELAY_BURST (1 << 20)   /* bytes moved between yields to the runqueue */
+
+typedef struct {
+    int src, dst;
+    int pipe[2];        /* splice mode */
+    char *buf;          /* copy mode, when splice() does not work on src or dst */
+    size_t pending;     /* in the pipe or buf */
+    size_t bufpos;
+    int eof, shut;
+    int want_in, want_out;
+    uint64_t moved;
+} relay_dir_t;
+
+/* falls back to copying. only done while the pipe is empty. */
+static int
+relay_dir_copymode(relay_dir_t *d) {
+    if (!(d->buf = malloc(RELAY_CHUNK)))
+        return errno = ENOMEM, -1;
+    if (d->pipe[0] != -1) {
+        close(d->pipe[0]);
+        close(d->pipe[1]);
+        d->pipe[0] = d->pipe[1] = -1;
+    }
+    return 0;
+}
+
+static int
+relay_dir_init(relay_dir_t *d, int src, int dst) {
+    memset(d, 0, sizeof(*d));
+    d->src = src;
+    d->dst = dst;
+    if (pipe2(d->pipe, O_NONBLOCK | O_CLOEXEC) == -1) {
+        d->pipe[0] = d->pipe[1] = -1;
+        return relay_dir_copymode(d);
+    }
+    return 0;
+}
+
+static void
+relay_dir_fini(relay_dir_t *d) {
+    if (d->pipe[0] != -1) {
+        close(d->pipe[0]);
+        close(d->pipe[1]);
+    }
+    free(d->buf);
+}
+
+#define RELAY_AGAIN(e) ((e) == EAGAIN || (e) == EWOULDBLOCK || (e) == EINTR)
+
+/* one read and one write in a direction. returns bytes moved, or -1 with errno set.
+   reads only into an empty pipe: a partly full one can refuse more while src
+   stays readable, and waiting on src would then spin. */
+static ssize_t
+relay_step(relay_dir_t *d) {
+    ssize_t n, progress = 0;
+    
+    d->want_in = d->want_out = 0;
+    if (!d->eof && !d->pending) {
+        if (!d->buf) {
+            n = splice(d->src, NULL, d->pipe[1], NULL, RELAY_CHUNK, 
+                    SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (n == -1 && (errno == EINVAL || errno == ENOSYS)) {
+                if (relay_dir_copymode(d) == -1)
+                    return -1;
+            }
+        }
+        if (d->buf) {
+            d->bufpos = 0;
+            n = read(d->src, d->buf, RELAY_CHUNK);
+        }
+        if (n > 0) {
+            d->pending += n;
+            progress += n;
+        } else if (n == 0) {
+            d->eof = 1;
+        } else if (RELAY_AGAIN(errno)) {
+            d->want_in = 1;
+        } else
+            return -1;
+    }
+    if (d->pending) {
+        if (d->buf)
+            n = write(d->dst, d->buf + d->bufpos, d->pending);
+        else
+            n = splice(d->pipe[0], NULL, d->dst, NULL, d->pending, 
+                    SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n > 0) {
+            d->pending -= n;
+            d->bufpos += n;
+            d->moved += n;
+            progress += n;
+        } else if (n == -1 && RELAY_AGAIN(errno)) {
+            d->want_out = 1;
+        } else if (n == -1)
+            return -1;
+    }
+    if (d->eof && !d->pending && !d->shut) {
+        shutdown(d->dst, SHUT_WR);
+        d->shut = 1;
+    }
+    return progress;
+}
+
+/* keeps the private epoll set in line with what the directions wait for */
+static int
+relay_interest(int epfd, int fd, int events, int *registered) {
+    struct epoll_event ev;
+    int op;
+    
+    if (!events && !*registered)
+        return 0;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.fd = fd;
+    op = !events ? EPOLL_CTL_DEL : *registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+    *registered = events != 0;
+    return epoll_ctl(epfd, op, fd, &ev);
+}
+
+/* runs with the GIL released. returns an IO_ status */
+static int
+relay_run(relay_dir_t *ab, relay_dir_t *ba, double idle_timeout) {
+    int epfd, reg_a = 0, reg_b = 0, status = IO_OK;
+    ssize_t n, m;
+    size_t burst = 0;
+    
+    if ((epfd = epoll_create1(EPOLL_CLOEXEC)) == -1)
+        return errno;
+    for (;;) {
+        if ((n = relay_step(ab)) == -1 || (m = relay_step(ba)) == -1) {
+            status = errno;
+            break;
+        }
+        if (ab->shut && ba->shut)
+            break;
+        if (n + m) {
+            /* don't starve everyone else when both ends are fast */
+            if ((burst += n + m) >= RELAY_BURST) {
+                burst = 0;
+                coev_stall();
+            }
+            continue;
+        }
+        if (relay_interest(epfd, ab->src, (ab->want_in ? EPOLLIN : 0) | (ba->want_out ? EPOLLOUT : 0), &reg_a) == -1
+         || relay_interest(epfd, ba->src, (ba->want_in ? EPOLLIN : 0) | (ab->want_out ? EPOLLOUT : 0), &reg_b) == -1) {
+            status = errno;
+            break;
+        }
+        coev_wait(epfd, COEV_READ, idle_timeout);
+        if (coev_current()->status == CSW_TIMEOUT) {
+            status = ETIMEDOUT;
+            break;
+        }
+        if (coev_current()->status != CSW_EVENT) {
+            status = EINTR;
+            break;
+        }
+    }
+    close(epfd);
+    return status;
+}
+
+PyDoc_STRVAR(mod_relay_doc,
+"relay(fd_a, fd_b, idle_timeout) -> (status, a_to_b, b_to_a)\n\n\
+Proxy bytes between two non-blocking sockets in both directions until\n\
+both are done, all within the calling coroutine and without copying\n\
+through Python. EOF from one side is passed on as shutdown(SHUT_WR)\n\
+of the other. Returns an IO_OK or errno status, as the try_ calls do\n\
+(ETIMEDOUT when nothing moved for idle_timeout seconds, EPIPE or\n\
+ECONNRESET when a side went away), and the byte counts moved.\n\
+The fds are left open.");
+
+static PyObject *
+mod_relay(PyObject *a, PyObject *args) {
+    PyThreadState *tstate;
+    relay_dir_t ab, ba;
+    int fd_a, fd_b, status;
+    double idle_timeout;
+    
+    if (!PyArg_ParseTuple(args, "iid", &fd_a, &fd_b, &idle_timeout))
+	return NULL;
+    if (relay_dir_init(&ab, fd_a, fd_b) == -1) {
+        relay_dir_fini(&ab);
+        return PyErr_NoMemory();
+    }
+    if (relay_dir_init(&ba, fd_b, fd_a) == -1) {
+        relay_dir_fini(&ab);
+        relay_dir_fini(&ba);
+        return PyErr_NoMemory();
+    }
+    
+    TRACE(TRACE_WAIT_START, fd_a, COEV_READ);
+    wait_note(fd_a, COEV_READ);
+    tstate = switch_out(NULL);
+    status = relay_run(&ab, &ba, idle_timeout);
+    switch_in(tstate);
+    TRACE(TRACE_WAIT_END, 0, status);
+    
+    relay_dir_fini(&ab);
+    relay_dir_fini(&ba);
+    return Py_BuildValue("(iKK)", status, 
+        (unsigned PY_LONG_LONG)ab.moved, (unsigned PY_LONG_LONG)ba.moved);
+}
+
+/** fd passing over unix sockets, for coev.restart **/
+
+#define FDS_MAX 253     /* SCM_MAX_FD */
+
+/* sendmsg()/recvmsg() on a non-blocking socket, waiting for it as needed.
+   runs with the GIL released. */
+static ssize_t
+sock_msg_io(int sock, struct msghdr *msg, int sending, double timeout) {
+    ssize_t rv;
+    
+    for (;;) {
+        if (sending)
+            rv = sendmsg(sock, msg, MSG_NOSIGNAL);
+        else
+            rv = recvmsg(sock, msg, MSG_CMSG_CLOEXEC);
+        if (rv >= 0)
+            return rv;
+        if (errno == EINTR)
+            continue;
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
+            return -1;
+        coev_wait(sock, sending ? COEV_WRITE : COEV_READ, timeout);
+        if (coev_current()->status != CSW_EVENT) {
+            errno = coev_current()->status == CSW_TIMEOUT ? ETIMEDOUT : EINTR;
+            return -1;
+        }
+    }
+}
+
+static ssize_t
+sock_msg_io_switched(int sock, struct msghdr *msg, int sending, double timeout) {
+    PyThreadState *tstate;
+    uint64_t start;
+    ssize_t rv;
+    int err;
+    
+    start = now_ns();
+    TRACE(TRACE_WAIT_START, sock, sending ? COEV_WRITE : COEV_READ);
+    wait_note(sock, sending ? COEV_WRITE : COEV_READ);
+    tstate = switch_out(NULL);
+    rv = sock_msg_io(sock, msg, sending, timeout);
+    err = errno;
+    switch_in(tstate);
+    wait_account(start, rv == -1 && err == ETIMEDOUT);
+    TRACE(TRACE_WAIT_END, rv, rv == -1 ? err : 0);
+    errno = err;
+    return rv;
+}
+
+PyDoc_STRVAR(mod_send_fds_doc,
+"send_fds(sock, data, fds, timeout) -> int\n\n\
+Send data with fds attached (SCM_RIGHTS) over a non-blocking unix\n\
+socket, waiting for it to become writable. data must not be empty;\n\
+at most 253 fds at a time. Returns the number of bytes sent.");
+
+static PyObject *
+mod_send_fds(PyObject *a, PyObject *args) {
+    int sock, *fdp;
+    const char *data;
+    Py_ssize_t len, i, n, rv;
+    PyObject *fds, *fast;
+    double timeout;
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *ch;
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(int) * FDS_MAX)];
+    } cmsg;
+    
+    if (!PyArg_ParseTuple(args, "is#Od", &sock, &data, &len, &fds, &timeout))
+	return NULL;
+    if (len == 0) {
+        PyErr_SetString(PyExc_ValueError, "data must not be empty");
+        return NULL;
+    }
+    if (!(fast = PySequence_Fast(fds, "fds must be a sequence of ints")))
+        return NULL;
+    if ((n = PySequence_Fast_GET_SIZE(fast)) > FDS_MAX) {
+        Py_DECREF(fast);
+        PyErr_SetString(PyExc_ValueError, "at most 253 fds at a time");
+        return NULL;
+    }
+    memset(&msg, 0, sizeof(msg));
+    memset(&cmsg, 0, sizeof(cmsg));
+    iov.iov_base = (void *)data;
+    iov.iov_len = len;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if (n) {
+        msg.msg_control = cmsg.buf;
+        msg.msg_controllen = CMSG_SPACE(sizeof(int) * n);
+        ch = CMSG_FIRSTHDR(&msg);
+        ch->cmsg_level = SOL_SOCKET;
+        ch->cmsg_type = SCM_RIGHTS;
+        ch->cmsg_len = CMSG_LEN(sizeof(int) * n);
+        fdp = (int *)CMSG_DATA(ch);
+        for (i = 0; i < n; i++) {
+            fdp[i] = (int)PyInt_AsLong(PySequence_Fast_GET_ITEM(fast, i));
+            if (fdp[i] == -1 && PyErr_Occurred()) {
+                Py_DECREF(fast);
+                return NULL;
+            }
+        }
+    }
+    Py_DECREF(fast);
+    
+    if ((rv = sock_msg_io_switched(sock, &msg, 1, timeout)) == -1)
+        return PyErr_SetFromErrno(PyExc_CoroSocketError);
+    return PyInt_FromSsize_t(rv);
+}
+
+PyDoc_STRVAR(mod_recv_fds_doc,
+"recv_fds(sock, size, timeout) -> (data, fds)\n\n\
+Receive up to size bytes and the fds sent along with them (close-on-exec)\n\
+from a non-blocking unix socket, waiting for it to become readable.\n\
+Returns ('', []) on EOF.");
+
+static PyObject *
+mod_recv_fds(PyObject *a, PyObject *args) {
+    int sock, *fdp;
+    Py_ssize_t size, rv, i, n;
+    PyObject *data, *fds = NULL, *fd;
+    double timeout;
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *ch;
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(int) * FDS_MAX)];
+    } cmsg;
+    
+    if (!PyArg_ParseTuple(args, "ind", &sock, &size, &timeout))
+	return NULL;
+    if (size <= 0) {
+        PyErr_SetString(PyExc_ValueError, "size must be positive");
+        return NULL;
+    }
+    if (!(data = PyString_FromStringAndSize(NULL, size)))
+        return NULL;
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = PyString_AS_STRING(data);
+    iov.iov_len = size;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cmsg.buf;
+    msg.msg_controllen = sizeof(cmsg.buf);
+    
+    if ((rv = sock_msg_io_switched(sock, &msg, 0, timeout)) == -1) {
+        Py_DECREF(data);
+        return PyErr_SetFromErrno(PyExc_CoroSocketError);
+    }
+    /* whatever fds came are ours to close from here on */
+    if (_PyString_Resize(&data, rv) < 0 || !(fds = PyList_New(0)))
+        goto fail;
+    for (ch = CMSG_FIRSTHDR(&msg); ch; ch = CMSG_NXTHDR(&msg, ch)) {
+        if (ch->cmsg_level != SOL_SOCKET || ch->cmsg_type != SCM_RIGHTS)
+            continue;
+        fdp = (int *)CMSG_DATA(ch);
+        n = (ch->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (i = 0; i < n; i++) {
+            if (!(fd = PyInt_FromLong(fdp[i])) || PyList_Append(fds, fd) < 0) {
+                Py_XDECREF(fd);
+                goto fail;
+            }
+            Py_DECREF(fd);
+            fdp[i] = -1;
+        }
+    }
+    if (msg.msg_flags & MSG_CTRUNC) {
+        PyErr_SetString(PyExc_CoroProtocolError, "fds truncated");
+        goto fail;
+    }
+    return Py_BuildValue("(NN)", data, fds);
+    
+  fail:
+    for (ch = CMSG_FIRSTHDR(&msg); ch; ch = CMSG_NXTHDR(&msg, ch)) {
+        if (ch->cmsg_level != SOL_SOCKET || ch->cmsg_type != SCM_RIGHTS)
+            continue;
+        fdp = (int *)CMSG_DATA(ch);
+        n = (ch->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (i = 0; i < n; i++)
+            if (fdp[i] != -1)
+                close(fdp[i]);
+    }
+    for (i = 0; fds && i < PyList_GET_SIZE(fds); i++)
+        close((int)PyInt_AS_LONG(PyList_GET_ITEM(fds, i)));
+    Py_XDECREF(fds);
+    Py_XDECREF(data);
+    return NULL;
+}
+
 PyDoc_STRVAR(mod_setdebug_doc,
 "setdebug([module=False, [library=0]) -> \n\n\
 module -- enable module-level debug output.\n\
@@ -929,14 +4363,39 @@ static PyMethodDef CoevMethods[] = {
     {   "throw", mod_throw, METH_VARARGS, mod_throw_doc },
     {   "wait", mod_wait, METH_VARARGS, mod_wait_doc },
     {   "sleep", mod_sleep, METH_VARARGS, mod_sleep_doc },
+    {   "try_wait", mod_try_wait, METH_VARARGS, mod_try_wait_doc },
+    {   "try_sleep", mod_try_sleep, METH_VARARGS, mod_try_sleep_doc },
     {   "stall", mod_stall, METH_NOARGS, mod_stall_doc },
     {   "switch2scheduler", mod_switch2scheduler, METH_NOARGS, mod_switch2scheduler_doc },
     {   "schedule", mod_schedule, METH_VARARGS, mod_schedule_doc},
     {   "scheduler", mod_scheduler, METH_NOARGS, mod_scheduler_doc },
     {   "stats", mod_stats, METH_NOARGS, mod_stats_doc },
+    {   "histograms", (PyCFunction)mod_histograms,
+        METH_VARARGS | METH_KEYWORDS, mod_histograms_doc },
     {   "setdebug", (PyCFunction)mod_setdebug,
         METH_VARARGS | METH_KEYWORDS, mod_setdebug_doc },
+    {   "trace_start", mod_trace_start, METH_VARARGS, mod_trace_start_doc },
+    {   "trace_stop", mod_trace_stop, METH_NOARGS, mod_trace_stop_doc },
+    {   "trace_dump", mod_trace_dump, METH_VARARGS, mod_trace_dump_doc },
     {   "getpos", mod_getpos, METH_VARARGS, mod_getpos_doc},
+    {   "cputime", mod_cputime, METH_VARARGS, mod_cputime_doc},
+    {   "top", mod_top, METH_VARARGS, mod_top_doc},
+    {   "setwatchdog", mod_setwatchdog, METH_VARARGS, mod_setwatchdog_doc},
+    {   "stackinfo", mod_stackinfo, METH_VARARGS, mod_stackinfo_doc},
+    {   "setstacksize", mod_setstacksize, METH_VARARGS, mod_setstacksize_doc},
+    {   "starter", mod_starter, METH_VARARGS, mod_starter_doc},
+    {   "hogs", mod_hogs, METH_NOARGS, mod_hogs_doc},
+    {   "setfastswitch", mod_setfastswitch, METH_VARARGS, mod_setfastswitch_doc},
+    {   "overloaded", mod_overloaded, METH_NOARGS, mod_overloaded_doc},
+    {   "setoverload", mod_setoverload, METH_VARARGS, mod_setoverload_doc},
+    {   "snapshot", (PyCFunction)mod_snapshot, 
+        METH_VARARGS | METH_KEYWORDS, mod_snapshot_doc},
+    {   "pidfd_open", mod_pidfd_open, METH_VARARGS, mod_pidfd_open_doc},
+    {   "relay", mod_relay, METH_VARARGS, mod_relay_doc},
+    {   "send_fds", mod_send_fds, METH_VARARGS, mod_send_fds_doc},
+    {   "recv_fds", mod_recv_fds, METH_VARARGS, mod_recv_fds_doc},
+    {   "local_snapshot", mod_local_snapshot, METH_NOARGS, mod_local_snapshot_doc},
+    {   "local_restore", mod_local_restore, METH_VARARGS, mod_local_restore_doc},
         
     { 0 }
 };
@@ -964,6 +4423,10 @@ init_coev(void) {
     
     if (PyType_Ready(&CoroSocketFile_Type) < 0)
         return;
+    if (PyType_Ready(&LocalSlots_Type) < 0 || PyType_Ready(&CoroLocal_Type) < 0)
+        return;
+    if (!(local_slots_key = PyString_InternFromString("coev.local.slots")))
+        return;
 
     { /* add exceptions */
         PyObject* exc_obj;
@@ -1005,6 +4468,8 @@ init_coev(void) {
     
     Py_INCREF(&CoroSocketFile_Type);
     PyModule_AddObject(m, "socketfile", (PyObject*) &CoroSocketFile_Type);
+    Py_INCREF(&CoroLocal_Type);
+    PyModule_AddObject(m, "local", (PyObject*) &CoroLocal_Type);
     
      /* Initialize the C API pointer array */
     PyCoev_API[PyCoev_wait_bottom_half_NUM] = (void *)mod_wait_bottom_half;
@@ -1023,5 +4488,8 @@ init_coev(void) {
         PyThread_release_lock(l);
     }
     
+    /* ucoev threading model is in effect iff thread ids are coev_t pointers */
+    fastswitch = ucoev_threads = (PyThread_get_thread_ident() == (long)coev_current());
+    
     Py_AtExit(coev_dmflush);
 }
@@ -28,7 +28,7 @@ daext = Extension(
     name='_coev', 
     sources=['modcoev.c'], 
     undef_macros=['NDEBUG'],
-    libraries=['ucoev']
+    libraries=['ucoev', 'rt']
     )
 
 setup(